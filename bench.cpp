@@ -0,0 +1,168 @@
+#include "includes/ptyps/web/ws.hpp"
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+// Microbenchmarks for the websocket hot paths, each against what it
+// replaced, which is kept here as it was for comparison.
+//
+//   make bench && ./dist/bench
+
+#include <chrono>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+namespace legacy {
+  // ws::decode as it was: whatever was left over is glued onto the front
+  // of each read, the lot is copied into a vector, every payload is
+  // copied into a string of its own and every frame is erased from the
+  // front of the vector once it's handled
+  void decode(std::string recvd, std::string &rxbuf, std::function<void(std::string)> func) {
+    if (rxbuf.length())
+      recvd = rxbuf + recvd;
+
+    rxbuf.clear();
+
+    auto vect = std::vector<uint8_t>(recvd.begin(), recvd.end());
+
+    while (!0) {
+      if (vect.size() < 2) {
+        rxbuf.append(vect.begin(), vect.end());
+        break;
+      }
+
+      auto msk = (vect[1] & ptyps::web::ws::MASK) == ptyps::web::ws::MASK;
+      auto len = uint64_t(vect[1] & 0x7F);
+      auto pos = 2;
+
+      if (len == 126) {
+        len = (uint64_t(vect[2]) << 8) | vect[3];
+        pos = 4;
+      }
+
+      else if (len == 127) {
+        len = 0;
+
+        for (auto i = 2; i < 10; i++)
+          len = (len << 8) | vect[i];
+
+        pos = 10;
+      }
+
+      auto size = pos + (msk ? ptyps::web::ws::MASKLEN : 0);
+      auto total = size + len;
+
+      if (vect.size() < total) {
+        rxbuf.append(vect.begin(), vect.end());
+        break;
+      }
+
+      func(std::string(vect.begin() + size, vect.begin() + total));
+
+      vect.erase(vect.begin(), vect.begin() + total);
+    }
+  }
+
+  // the byte at a time masking loop encode had
+  void mask(char* data, size_t length, const ptyps::web::ws::masking_key &key) {
+    for (auto i = size_t(0); i != length; ++i)
+      data[i] ^= key[i & 0x03];
+  }
+}
+
+// -----
+
+// a GUILD_CREATE of members members followed by count small dispatches,
+// as unmasked server frames, the way a shard sees them after READY
+static std::string burst(size_t members, size_t count) {
+  auto guild = std::string(R"({"op":0,"s":2,"t":"GUILD_CREATE","d":{"id":"1000","name":"guild","members":[)");
+
+  for (auto i = size_t(0); i < members; i++) {
+    guild += (i ? "," : "") + std::string(R"({"user":{"id":")") + std::to_string(100000000000 + i) + R"(","username":"user)" + std::to_string(i);
+    guild += R"(","discriminator":"0001","avatar":null},"roles":[],"joined_at":"2022-02-18T00:00:00.000000+00:00","deaf":false,"mute":false})";
+  }
+
+  guild += "]}}";
+
+  auto out = ptyps::web::ws::encode(!1, ptyps::web::ws::opcode::TEXT, guild);
+
+  for (auto i = size_t(0); i < count; i++) {
+    auto message = R"({"op":0,"s":)" + std::to_string(i + 3) + R"(,"t":"MESSAGE_CREATE","d":{"id":")" + std::to_string(i) + R"(","content":"hello there","channel_id":"10001"}})";
+    out += ptyps::web::ws::encode(!1, ptyps::web::ws::opcode::TEXT, message);
+  }
+
+  return out;
+}
+
+// runs func over data in reads of chunk bytes, rounds times, in MB/s
+template <typename F>
+  static double rate(const std::string &data, size_t chunk, int rounds, F func) {
+    auto start = clock_type::now();
+
+    for (auto round = 0; round < rounds; round++)
+      for (auto i = size_t(0); i < data.size(); i += chunk)
+        func(std::string_view(data).substr(i, chunk));
+
+    auto spent = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    return data.size() * double(rounds) / spent / 1e6;
+  }
+
+static void decoders() {
+  auto data = burst(5000, 2000);
+  auto rounds = 10;
+
+  // a TLS record's worth at a time, which is what a read hands over
+  for (auto chunk : {size_t(1024), size_t(16384), size_t(65536)}) {
+    auto messages = size_t(0);
+    auto rxbuf = std::string();
+
+    auto old = rate(data, chunk, rounds, [&](std::string_view piece) {
+      legacy::decode(std::string(piece), rxbuf, [&](std::string message) {
+        messages++;
+      });
+    });
+
+    auto seen = messages;
+    auto decoder = ptyps::web::ws::Decoder();
+
+    messages = 0;
+
+    auto now = rate(data, chunk, rounds, [&](std::string_view piece) {
+      decoder.feed(piece, [&](ptyps::web::ws::opcode op, ptyps::web::ws::decode_variant message, bool fin) {
+        messages++;
+      });
+    });
+
+    printf("decode %.1f MB in %5lu byte reads: ws::decode %8.1f MB/s, ws::Decoder %8.1f MB/s (%.1fx), %lu and %lu messages\r\n",
+      data.size() / 1e6, chunk, old, now, now / old, seen, messages);
+  }
+}
+
+static void masks() {
+  auto key = ptyps::web::ws::createMaskingKey();
+
+  for (auto size : {size_t(125), size_t(4096), size_t(16 << 20)}) {
+    auto data = std::string(size, 'x');
+    auto rounds = int(std::max<size_t>((256 << 20) / size, 1));
+
+    auto old = rate(data, size, rounds, [&](std::string_view piece) {
+      legacy::mask(data.data(), data.size(), key);
+    });
+
+    auto now = rate(data, size, rounds, [&](std::string_view piece) {
+      ptyps::web::ws::mask(data.data(), data.size(), key);
+    });
+
+    // as many rounds of each, so it ends up as it started
+    if (data != std::string(size, 'x'))
+      printf("mask didn't undo itself\r\n");
+
+    printf("mask %8lu bytes: byte loop %8.1f MB/s, ws::mask %8.1f MB/s (%.1fx)\r\n", size, old, now, now / old);
+  }
+}
+
+int main(int argc, char** argv) {
+  decoders();
+  masks();
+}
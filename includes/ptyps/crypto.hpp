@@ -29,6 +29,15 @@ namespace ptyps::crypto {
     return std::string(buffer);
   }
 
+  // the raw 20 byte digest, rather than sha1()'s hex
+  std::string sha1_digest(std::string_view in) {
+    auto out = std::string(SHA_DIGEST_LENGTH, '\0');
+
+    SHA1((const u_char *) in.data(), in.size(), (u_char *) out.data());
+
+    return out;
+  }
+
   // ---- base64
   
   static const std::string b64chars
@@ -39,9 +48,9 @@ namespace ptyps::crypto {
   std::string base64(std::string data) {
     auto out = std::string();
     auto valb = -6;
-    auto vala = 0;
+    auto vala = uint32_t(0);
 
-    for (auto next : data) {
+    for (u_char next : data) {
       vala = (vala << 8) + next;
       valb += 8;
 
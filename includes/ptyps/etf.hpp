@@ -0,0 +1,846 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <string_view>
+#include <optional>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <bit>
+
+#include "./json.hpp"
+
+// Erlang's external term format, which the gateway speaks when asked for
+// encoding=etf. Terms are read in place: a Term is a view of the bytes it
+// was sent as, integers come out as native 64 bit types and binaries as
+// views into the frame, so nothing is allocated unless to_json() is asked
+// for. The accessors mirror ptyps::json's, so value<T>(term, "d.id") reads
+// the same as it does for a json::obj.
+
+namespace ptyps::etf {
+  using exception = ptyps::err::exception;
+
+  constexpr auto npos = std::string_view::npos;
+
+  constexpr uint8_t VERSION = 131;
+
+  constexpr uint8_t NEW_FLOAT = 70;
+  constexpr uint8_t SMALL_INTEGER = 97;
+  constexpr uint8_t INTEGER = 98;
+  constexpr uint8_t FLOAT = 99;
+  constexpr uint8_t ATOM = 100;
+  constexpr uint8_t SMALL_TUPLE = 104;
+  constexpr uint8_t LARGE_TUPLE = 105;
+  constexpr uint8_t NIL = 106;
+  constexpr uint8_t STRING = 107;
+  constexpr uint8_t LIST = 108;
+  constexpr uint8_t BINARY = 109;
+  constexpr uint8_t SMALL_BIG = 110;
+  constexpr uint8_t LARGE_BIG = 111;
+  constexpr uint8_t SMALL_ATOM = 115;
+  constexpr uint8_t MAP = 116;
+  constexpr uint8_t ATOM_UTF8 = 118;
+  constexpr uint8_t SMALL_ATOM_UTF8 = 119;
+
+  // nesting deeper than this is taken as a broken frame
+  constexpr int DEPTH = 256;
+
+  // big endian reads, data has to have the bytes
+
+  inline uint16_t be16(std::string_view data, size_t at) {
+    auto out = uint16_t();
+    std::memcpy(&out, data.data() + at, sizeof(out));
+    return std::endian::native == std::endian::big ? out : __builtin_bswap16(out);
+  }
+
+  inline uint32_t be32(std::string_view data, size_t at) {
+    auto out = uint32_t();
+    std::memcpy(&out, data.data() + at, sizeof(out));
+    return std::endian::native == std::endian::big ? out : __builtin_bswap32(out);
+  }
+
+  inline uint64_t be64(std::string_view data, size_t at) {
+    auto out = uint64_t();
+    std::memcpy(&out, data.data() + at, sizeof(out));
+    return std::endian::native == std::endian::big ? out : __builtin_bswap64(out);
+  }
+
+  // just past the term at p, nullptr if it runs past end or isn't
+  // something the gateway sends
+  inline const uint8_t* measure(const uint8_t* p, const uint8_t* end, int depth = 0) {
+    if (p >= end || depth > DEPTH)
+      return nullptr;
+
+    auto left = size_t(end - p);
+
+    auto need = [&](size_t head, size_t body) -> const uint8_t* {
+      return left < head || left - head < body ? nullptr : p + head + body;
+    };
+
+    auto count = size_t();
+
+    switch (p[0]) {
+      case SMALL_INTEGER:
+        return need(2, 0);
+
+      case INTEGER:
+        return need(5, 0);
+
+      case NEW_FLOAT:
+        return need(9, 0);
+
+      case FLOAT:
+        return need(32, 0);
+
+      case NIL:
+        return p + 1;
+
+      case SMALL_ATOM:
+      case SMALL_ATOM_UTF8:
+        return left < 2 ? nullptr : need(2, p[1]);
+
+      case ATOM:
+      case ATOM_UTF8:
+      case STRING:
+        return left < 3 ? nullptr : need(3, size_t(p[1]) << 8 | p[2]);
+
+      case BINARY:
+        return left < 5 ? nullptr : need(5, size_t(p[1]) << 24 | size_t(p[2]) << 16 | size_t(p[3]) << 8 | p[4]);
+
+      case SMALL_BIG:
+        return left < 2 ? nullptr : need(3, p[1]);
+
+      case LARGE_BIG:
+        return left < 5 ? nullptr : need(6, size_t(p[1]) << 24 | size_t(p[2]) << 16 | size_t(p[3]) << 8 | p[4]);
+
+      case SMALL_TUPLE:
+        if (left < 2)
+          return nullptr;
+
+        count = p[1];
+        p += 2;
+        break;
+
+      case LARGE_TUPLE:
+      case LIST:
+      case MAP:
+        if (left < 5)
+          return nullptr;
+
+        count = size_t(p[1]) << 24 | size_t(p[2]) << 16 | size_t(p[3]) << 8 | p[4];
+
+        // lists end with a tail, maps hold pairs
+        if (p[0] == LIST)
+          count++;
+
+        if (p[0] == MAP)
+          count *= 2;
+
+        p += 5;
+        break;
+
+      default:
+        return nullptr;
+    }
+
+    for (auto i = size_t(0); i < count && p; i++)
+      p = measure(p, end, depth + 1);
+
+    return p;
+  }
+
+  // bytes the term at the front of data takes up, npos if it's broken
+  inline size_t length(std::string_view data) {
+    auto from = (const uint8_t *) data.data();
+    auto past = measure(from, from + data.size());
+
+    return past ? size_t(past - from) : npos;
+  }
+
+  // -----
+
+  // A view of one term. Made by decode(), which checks the whole frame, so
+  // the reads below don't check bounds again.
+
+  class Term {
+    private:
+      std::string_view data;
+
+      // an element of a STRING, which is a list of small integers packed
+      // one to a byte; data is then that byte, with no tag of its own
+      int16_t byte = -1;
+
+      Term(std::string_view data, uint8_t byte) : data(data), byte(byte) {
+
+      }
+
+      uint8_t tag() const {
+        return byte < 0 ? data[0] : SMALL_INTEGER;
+      }
+
+      // where the first element of a tuple, list or map starts
+      size_t header() const {
+        return tag() == SMALL_TUPLE ? 2 : 5;
+      }
+
+      std::string_view atom() const {
+        if (tag() == SMALL_ATOM || tag() == SMALL_ATOM_UTF8)
+          return data.substr(2);
+
+        if (tag() == ATOM || tag() == ATOM_UTF8)
+          return data.substr(3);
+
+        return {};
+      }
+
+      // a small or large big's magnitude, if it fits in 64 bits
+      std::optional<uint64_t> magnitude() const {
+        auto size = tag() == SMALL_BIG ? size_t(uint8_t(data[1])) : be32(data, 1);
+        auto digits = data.substr(tag() == SMALL_BIG ? 3 : 6);
+
+        auto out = uint64_t();
+
+        for (auto i = size; i > 0; i--) {
+          auto next = uint8_t(digits[i - 1]);
+
+          if (i > 8 && next)
+            return {};
+
+          if (i <= 8)
+            out |= uint64_t(next) << ((i - 1) * 8);
+        }
+
+        return out;
+      }
+
+      bool negative() const {
+        return data[tag() == SMALL_BIG ? 2 : 5] != 0;
+      }
+
+    public:
+      Term(std::string_view data) : data(data) {
+
+      }
+
+      // the bytes the term was sent as, or just the one for an element of
+      // a STRING
+      std::string_view bytes() const {
+        return data;
+      }
+
+      bool is_map() const {
+        return tag() == MAP;
+      }
+
+      bool is_list() const {
+        return tag() == LIST || tag() == NIL || tag() == STRING;
+      }
+
+      bool is_tuple() const {
+        return tag() == SMALL_TUPLE || tag() == LARGE_TUPLE;
+      }
+
+      bool is_binary() const {
+        return tag() == BINARY;
+      }
+
+      bool is_atom() const {
+        return atom().data() != nullptr;
+      }
+
+      bool is_integer() const {
+        return tag() == SMALL_INTEGER || tag() == INTEGER || tag() == SMALL_BIG || tag() == LARGE_BIG;
+      }
+
+      bool is_float() const {
+        return tag() == NEW_FLOAT || tag() == FLOAT;
+      }
+
+      // the atom nil, which is what json's null turns into
+      bool is_null() const {
+        auto name = atom();
+        return name == "nil" || name == "null";
+      }
+
+      std::optional<bool> boolean() const {
+        auto name = atom();
+
+        if (name == "true")
+          return !0;
+
+        if (name == "false")
+          return !1;
+
+        return {};
+      }
+
+      std::optional<int64_t> integer() const {
+        if (tag() == SMALL_INTEGER)
+          return byte < 0 ? uint8_t(data[1]) : byte;
+
+        if (tag() == INTEGER)
+          return int32_t(be32(data, 1));
+
+        if (tag() != SMALL_BIG && tag() != LARGE_BIG)
+          return {};
+
+        auto found = magnitude();
+
+        if (!found)
+          return {};
+
+        if (negative())
+          return *found <= uint64_t(INT64_MAX) + 1 ? std::optional<int64_t>(-int64_t(*found - 1) - 1) : std::nullopt;
+
+        return *found <= uint64_t(INT64_MAX) ? std::optional<int64_t>(*found) : std::nullopt;
+      }
+
+      // ids come as integers here and as strings in json, so either will do
+      std::optional<uint64_t> snowflake() const {
+        if (tag() == SMALL_BIG || tag() == LARGE_BIG)
+          return negative() ? std::nullopt : magnitude();
+
+        if (is_integer()) {
+          auto found = integer();
+          return found && *found >= 0 ? std::optional<uint64_t>(*found) : std::nullopt;
+        }
+
+        auto digits = text();
+
+        if (!digits || digits->empty())
+          return {};
+
+        auto out = uint64_t();
+        auto [end, err] = std::from_chars(digits->data(), digits->data() + digits->size(), out);
+
+        if (err != std::errc() || end != digits->data() + digits->size())
+          return {};
+
+        return out;
+      }
+
+      std::optional<double> number() const {
+        if (tag() == NEW_FLOAT)
+          return std::bit_cast<double>(be64(data, 1));
+
+        if (tag() == FLOAT) {
+          auto digits = std::string(data.substr(1, 31));
+          return std::strtod(digits.c_str(), nullptr);
+        }
+
+        auto found = integer();
+
+        if (found)
+          return double(*found);
+
+        return {};
+      }
+
+      // binaries and atoms other than nil, true and false; a STRING is a
+      // list of small integers (term_to_binary packs [0, 1] that way), not
+      // text
+      std::optional<std::string_view> text() const {
+        if (tag() == BINARY)
+          return data.substr(5);
+
+        if (!is_atom() || is_null() || boolean())
+          return {};
+
+        return atom();
+      }
+
+      // elements of a list or tuple, pairs in a map
+      size_t size() const {
+        if (tag() == SMALL_TUPLE)
+          return uint8_t(data[1]);
+
+        if (tag() == LARGE_TUPLE || tag() == LIST || tag() == MAP)
+          return be32(data, 1);
+
+        if (tag() == STRING)
+          return be16(data, 1);
+
+        return 0;
+      }
+
+      // func(Term) for every element of a list or tuple
+      template <typename F>
+        void each(F func) const {
+          if (tag() == STRING) {
+            for (auto i = size_t(0); i < size(); i++)
+              func(Term(data.substr(3 + i, 1), uint8_t(data[3 + i])));
+
+            return;
+          }
+
+          if (!is_tuple() && tag() != LIST)
+            return;
+
+          auto at = header();
+
+          for (auto i = size_t(0); i < size(); i++) {
+            auto next = length(data.substr(at));
+            func(Term(data.substr(at, next)));
+            at += next;
+          }
+        }
+
+      // func(key, value) for every pair in a map
+      template <typename F>
+        void pairs(F func) const {
+          if (!is_map())
+            return;
+
+          auto at = header();
+
+          for (auto i = size_t(0); i < size(); i++) {
+            auto key = length(data.substr(at));
+            auto value = length(data.substr(at + key));
+
+            func(Term(data.substr(at, key)), Term(data.substr(at + key, value)));
+            at += key + value;
+          }
+        }
+
+      std::optional<Term> at(size_t index) const {
+        if (!is_list() || index >= size())
+          return {};
+
+        if (tag() == STRING)
+          return Term(data.substr(3 + index, 1), uint8_t(data[3 + index]));
+
+        auto at = header();
+
+        for (auto i = size_t(0); i < index; i++)
+          at += length(data.substr(at));
+
+        return Term(data.substr(at, length(data.substr(at))));
+      }
+
+      // the value under key, which can be an atom or a binary
+      std::optional<Term> find(std::string_view key) const {
+        if (!is_map())
+          return {};
+
+        auto at = header();
+
+        for (auto i = size_t(0); i < size(); i++) {
+          auto name = Term(data.substr(at, length(data.substr(at))));
+          at += name.bytes().size();
+
+          auto value = length(data.substr(at));
+          auto found = name.tag() == BINARY ? name.data.substr(5) : name.atom();
+
+          if (found == key)
+            return Term(data.substr(at, value));
+
+          at += value;
+        }
+
+        return {};
+      }
+
+      // the same conversions boost::json::value_to does for the json path
+      template <typename T>
+        std::optional<T> as() const {
+          if constexpr (std::is_same_v<T, bool>)
+            return boolean();
+
+          else if constexpr (std::is_same_v<T, uint64_t>)
+            return snowflake();
+
+          else if constexpr (std::is_integral_v<T>) {
+            auto found = integer();
+
+            if (!found || *found < std::numeric_limits<T>::min() || (*found > 0 && uint64_t(*found) > std::numeric_limits<T>::max()))
+              return {};
+
+            return T(*found);
+          }
+
+          else if constexpr (std::is_floating_point_v<T>)
+            return number();
+
+          else if constexpr (std::is_same_v<T, std::string_view>)
+            return text();
+
+          else if constexpr (std::is_same_v<T, std::string>) {
+            auto found = text();
+            return found ? std::optional<T>(std::string(*found)) : std::nullopt;
+          }
+
+          else
+            static_assert(!sizeof(T), "no etf conversion for this type");
+        }
+  };
+
+  // the term in a frame from the gateway, which has to be nothing but
+  // the version byte and one whole term
+  std::optional<Term> decode(std::string_view frame) {
+    if (frame.empty() || uint8_t(frame[0]) != VERSION)
+      return {};
+
+    frame.remove_prefix(1);
+
+    if (length(frame) != frame.size())
+      return {};
+
+    return Term(frame);
+  }
+
+  std::optional<Term> get(Term term, std::string_view prop) {
+    return term.find(prop);
+  }
+
+  template <typename T>
+    std::optional<T> value(Term term, std::string_view prop) {
+      while (prop.size()) {
+        auto dot = prop.find('.');
+        auto found = term.find(prop.substr(0, dot));
+
+        if (!found)
+          return {};
+
+        term = *found;
+        prop = dot == npos ? std::string_view() : prop.substr(dot + 1);
+      }
+
+      return term.template as<T>();
+    }
+
+  // the json the gateway would have sent instead; integers too big for a
+  // json number to hold exactly become strings, as ids are there
+  ptyps::json::obj to_json(Term term) {
+    if (term.is_null())
+      return nullptr;
+
+    auto flag = term.boolean();
+
+    if (flag)
+      return *flag;
+
+    if (term.is_integer()) {
+      auto found = term.integer();
+
+      if (found && *found >= -(int64_t(1) << 53) && *found <= (int64_t(1) << 53))
+        return *found;
+
+      auto id = term.snowflake();
+
+      if (id)
+        return std::to_string(*id);
+
+      return found ? ptyps::json::obj(std::to_string(*found)) : ptyps::json::obj(nullptr);
+    }
+
+    if (term.is_float())
+      return *term.number();
+
+    if (term.is_map()) {
+      auto out = boost::json::object();
+
+      term.pairs([&](Term key, Term value) {
+        auto name = key.text();
+
+        if (name)
+          out.emplace(*name, to_json(value));
+      });
+
+      return out;
+    }
+
+    auto text = term.text();
+
+    if (text)
+      return *text;
+
+    auto out = boost::json::array();
+
+    term.each([&](Term next) {
+      out.emplace_back(to_json(next));
+    });
+
+    return out;
+  }
+
+  // -----
+
+  // Writes terms one after another into a frame. Lists and maps are
+  // written as a header giving their size followed by that many elements
+  // (or key then value pairs); a list also has to be closed with tail().
+
+  class Encoder {
+    private:
+      std::string out;
+
+      void be(uint64_t value, size_t bytes) {
+        for (auto i = bytes; i > 0; i--)
+          out.push_back(char(value >> ((i - 1) * 8)));
+      }
+
+    public:
+      Encoder() {
+        out.push_back(char(VERSION));
+      }
+
+      Encoder &atom(std::string_view name) {
+        if (name.size() < 256) {
+          out.push_back(char(SMALL_ATOM_UTF8));
+          out.push_back(char(name.size()));
+        }
+
+        else {
+          out.push_back(char(ATOM_UTF8));
+          be(name.size(), 2);
+        }
+
+        out.append(name);
+        return *this;
+      }
+
+      Encoder &null() {
+        return atom("nil");
+      }
+
+      Encoder &boolean(bool value) {
+        return atom(value ? "true" : "false");
+      }
+
+      Encoder &integer(int64_t value) {
+        if (value >= 0 && value < 256) {
+          out.push_back(char(SMALL_INTEGER));
+          out.push_back(char(value));
+          return *this;
+        }
+
+        if (value >= INT32_MIN && value <= INT32_MAX) {
+          out.push_back(char(INTEGER));
+          be(uint32_t(value), 4);
+          return *this;
+        }
+
+        auto magnitude = value < 0 ? uint64_t(-(value + 1)) + 1 : uint64_t(value);
+        return big(magnitude, value < 0);
+      }
+
+      Encoder &big(uint64_t magnitude, bool negative = !1) {
+        auto digits = size_t(0);
+
+        for (auto next = magnitude; next; next >>= 8)
+          digits++;
+
+        out.push_back(char(SMALL_BIG));
+        out.push_back(char(digits));
+        out.push_back(char(negative));
+
+        for (auto i = size_t(0); i < digits; i++)
+          out.push_back(char(magnitude >> (i * 8)));
+
+        return *this;
+      }
+
+      Encoder &unsigned_integer(uint64_t value) {
+        if (value <= uint64_t(INT64_MAX))
+          return integer(int64_t(value));
+
+        return big(value);
+      }
+
+      Encoder &number(double value) {
+        out.push_back(char(NEW_FLOAT));
+        be(std::bit_cast<uint64_t>(value), 8);
+        return *this;
+      }
+
+      Encoder &binary(std::string_view data) {
+        out.push_back(char(BINARY));
+        be(data.size(), 4);
+        out.append(data);
+        return *this;
+      }
+
+      // an empty list is just the tail, with nothing before it
+      Encoder &list(size_t count) {
+        if (!count)
+          return tail();
+
+        out.push_back(char(LIST));
+        be(count, 4);
+        return *this;
+      }
+
+      Encoder &tail() {
+        out.push_back(char(NIL));
+        return *this;
+      }
+
+      Encoder &map(size_t pairs) {
+        out.push_back(char(MAP));
+        be(pairs, 4);
+        return *this;
+      }
+
+      // adds a json value, strings and keys as binaries
+      Encoder &json(const ptyps::json::obj &value) {
+        if (value.is_null())
+          return null();
+
+        if (value.is_bool())
+          return boolean(value.get_bool());
+
+        if (value.is_int64())
+          return integer(value.get_int64());
+
+        if (value.is_uint64())
+          return unsigned_integer(value.get_uint64());
+
+        if (value.is_double())
+          return number(value.get_double());
+
+        if (value.is_string()) {
+          auto &text = value.get_string();
+          return binary(std::string_view(text.data(), text.size()));
+        }
+
+        if (value.is_array()) {
+          auto &list = value.get_array();
+
+          this->list(list.size());
+
+          for (auto &next : list)
+            json(next);
+
+          return list.size() ? tail() : *this;
+        }
+
+        auto &object = value.get_object();
+
+        map(object.size());
+
+        for (auto &[key, next] : object) {
+          binary(std::string_view(key.data(), key.size()));
+          json(next);
+        }
+
+        return *this;
+      }
+
+      const std::string &frame() const {
+        return out;
+      }
+
+      std::string take() {
+        return std::move(out);
+      }
+  };
+
+  std::string encode(const ptyps::json::obj &value) {
+    return Encoder().json(value).take();
+  }
+
+  // -----
+
+  // The gateway envelope, the same shape as ptyps::json::Envelope: op, s
+  // and t read in place and d left as a term until someone wants it. When
+  // d is the last pair it runs to the end of the frame, so it isn't even
+  // checked until then.
+
+  class Envelope {
+    private:
+      std::optional<Term> d;
+      bool checked = !1;
+      bool good = !1;
+
+      bool scan(std::string_view frame) {
+        auto from = (const uint8_t *) frame.data();
+        auto end = from + frame.size();
+
+        if (frame.size() < 6 || from[0] != VERSION || from[1] != MAP)
+          return !1;
+
+        auto count = be32(frame, 2);
+        auto p = from + 6;
+
+        auto view = [](const uint8_t* a, const uint8_t* b) {
+          return std::string_view((const char *) a, b - a);
+        };
+
+        for (auto i = size_t(0); i < count; i++) {
+          auto past = measure(p, end);
+
+          if (!past)
+            return !1;
+
+          auto name = Term(view(p, past)).text();
+          auto lazy = name == "d" && i + 1 == count;
+
+          p = past;
+          past = lazy ? end : measure(p, end);
+
+          if (!past)
+            return !1;
+
+          auto value = Term(view(p, past));
+
+          if (name == "op")
+            op = value.integer();
+
+          else if (name == "s")
+            s = value.integer();
+
+          else if (name == "t")
+            t = value.text().value_or("");
+
+          else if (name == "d") {
+            d = value;
+            checked = !lazy;
+          }
+
+          p = past;
+        }
+
+        return p == end;
+      }
+
+    public:
+      std::optional<int64_t> op;
+      std::optional<int64_t> s;
+      std::string_view t; // empty when nil
+
+      // views into frame, which has to outlive the envelope
+      Envelope(std::string_view frame) {
+        good = scan(frame);
+      }
+
+      bool valid() {
+        return good;
+      }
+
+      // d, if there was one and it holds together
+      std::optional<Term> term() {
+        if (d && !checked) {
+          checked = !0;
+
+          if (length(d->bytes()) != d->bytes().size())
+            d.reset();
+        }
+
+        return d;
+      }
+
+      // d's raw term, which decode() won't take as it has no version byte;
+      // use Term(data()) on it
+      std::string_view data() {
+        auto found = term();
+        return found ? found->bytes() : std::string_view();
+      }
+
+      ptyps::json::obj parse() {
+        auto found = term();
+        return found ? to_json(*found) : ptyps::json::obj(nullptr);
+      }
+  };
+}
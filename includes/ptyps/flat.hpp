@@ -0,0 +1,231 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <initializer_list>
+#include <type_traits>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace ptyps::flat {
+  // Open addressing hash map from non-zero uint64_t keys (snowflakes) to V,
+  // probed linearly. Keys are kept apart from values so a probe only walks
+  // 8 bytes a slot, 0 marks a free slot, and erase() shifts what comes
+  // after back rather than leaving tombstones, so lookups don't slow down
+  // however much churn there is. Pointers into it last until the next
+  // insert or erase.
+
+  template <typename V>
+    class Map {
+      private:
+        std::vector<uint64_t> keys;
+        std::vector<V> values;
+        size_t used = 0;
+        size_t mask = 0;
+        int bits = 0;
+
+        // fibonacci hashing, as snowflakes' low bits barely change
+        size_t home(uint64_t key) const {
+          return (key * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+        }
+
+        // where key is, or the free slot it'd go in
+        size_t slot(uint64_t key) const {
+          auto i = home(key);
+
+          while (keys[i] && keys[i] != key)
+            i = (i + 1) & mask;
+
+          return i;
+        }
+
+        void rehash(size_t capacity) {
+          auto old_keys = std::move(keys);
+          auto old_values = std::move(values);
+
+          keys.assign(capacity, 0);
+          values.clear();
+          values.resize(capacity);
+
+          mask = capacity - 1;
+          bits = __builtin_ctzll(capacity);
+
+          for (auto i = size_t(0); i < old_keys.size(); i++) {
+            if (!old_keys[i])
+              continue;
+
+            auto at = slot(old_keys[i]);
+
+            keys[at] = old_keys[i];
+            values[at] = std::move(old_values[i]);
+          }
+        }
+
+      public:
+        // kept below 7/8 full
+        void reserve(size_t count) {
+          auto capacity = size_t(8);
+
+          while (capacity * 7 < count * 8)
+            capacity *= 2;
+
+          if (capacity > keys.size())
+            rehash(capacity);
+        }
+
+        V *find(uint64_t key) {
+          if (!used || !key)
+            return nullptr;
+
+          auto i = slot(key);
+          return keys[i] ? &values[i] : nullptr;
+        }
+
+        const V *find(uint64_t key) const {
+          return const_cast<Map *>(this)->find(key);
+        }
+
+        bool contains(uint64_t key) const {
+          return find(key) != nullptr;
+        }
+
+        // key's value, made if it isn't there; key can't be 0
+        V &operator[](uint64_t key) {
+          if (auto found = find(key))
+            return *found;
+
+          if ((used + 1) * 8 > keys.size() * 7)
+            rehash(std::max<size_t>(keys.size() * 2, 8));
+
+          auto i = slot(key);
+
+          keys[i] = key;
+          used++;
+
+          return values[i];
+        }
+
+        bool erase(uint64_t key) {
+          if (!used || !key)
+            return !1;
+
+          auto i = slot(key);
+
+          if (!keys[i])
+            return !1;
+
+          // pulls back anything that probed past i, as far as i if its home
+          // is no further on than i is
+          for (auto j = (i + 1) & mask; keys[j]; j = (j + 1) & mask) {
+            if (((j - home(keys[j])) & mask) < ((j - i) & mask))
+              continue;
+
+            keys[i] = keys[j];
+            values[i] = std::move(values[j]);
+            i = j;
+          }
+
+          keys[i] = 0;
+          values[i] = V();
+          used--;
+
+          return !0;
+        }
+
+        // func(key, value) for every entry, in no particular order
+        template <typename F>
+          void each(F func) {
+            for (auto i = size_t(0); i < keys.size(); i++)
+              if (keys[i])
+                func(keys[i], values[i]);
+          }
+
+        template <typename F>
+          void each(F func) const {
+            for (auto i = size_t(0); i < keys.size(); i++)
+              if (keys[i])
+                func(keys[i], values[i]);
+          }
+
+        // erases every entry func(key, value) is true for, in one pass
+        template <typename F>
+          size_t erase_if(F func) {
+            auto before = used;
+            auto kept = Map();
+
+            kept.reserve(used);
+
+            each([&](uint64_t key, V &value) {
+              if (!func(key, value))
+                kept[key] = std::move(value);
+            });
+
+            *this = std::move(kept);
+
+            return before - used;
+          }
+
+        void clear() {
+          keys.clear();
+          values.clear();
+          used = mask = 0;
+          bits = 0;
+        }
+
+        size_t size() const {
+          return used;
+        }
+
+        size_t capacity() const {
+          return keys.size();
+        }
+
+        // bytes the table itself takes, not what values point to
+        size_t memory() const {
+          return keys.capacity() * sizeof(uint64_t) + values.capacity() * sizeof(V);
+        }
+    };
+
+  // -----
+
+  // A bitset indexed by an enum and only as wide as W, where std::bitset
+  // is never smaller than a long.
+
+  template <typename E, typename W = uint8_t>
+    class Flags {
+      private:
+        static W bit(E which) {
+          return W(1) << std::underlying_type_t<E>(which);
+        }
+
+      public:
+        W bits = 0;
+
+        Flags() = default;
+
+        Flags(std::initializer_list<E> init) {
+          for (auto next : init)
+            set(next);
+        }
+
+        bool test(E which) const {
+          return bits & bit(which);
+        }
+
+        bool operator[](E which) const {
+          return test(which);
+        }
+
+        Flags &set(E which, bool value = !0) {
+          bits = value ? bits | bit(which) : bits & ~bit(which);
+          return *this;
+        }
+
+        bool any() const {
+          return bits != 0;
+        }
+
+        bool operator==(const Flags &) const = default;
+    };
+}
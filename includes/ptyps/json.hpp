@@ -4,6 +4,7 @@
 
 #include <boost/json/src.hpp>
 #include <boost/json.hpp>
+#include <charconv>
 #include <list>
 
 #include "./filesystem.hpp"
@@ -21,7 +22,7 @@ namespace ptyps::json {
   }
 
   obj parse(std::string_view str) {
-    return boost::json::parse(&str[0]);
+    return boost::json::parse(boost::json::string_view(str.data(), str.size()));
   }
 
   obj open(std::string_view file) {
@@ -57,13 +58,12 @@ namespace ptyps::json {
         if (!next)
           break;
 
-        try {
-          o = *get(o, &(*next)[0]);
-        }
+        auto found = get(o, &(*next)[0]);
 
-        catch (const std::exception &err) {
+        if (!found)
           return {};
-        }
+
+        o = *found;
       }
 
       try {
@@ -79,4 +79,213 @@ namespace ptyps::json {
     void put(obj &o, std::string_view prop, T result) {
       o.as_object().emplace(&prop[0], result);
     }
-}
\ No newline at end of file
+
+  // -----
+
+  // skimming raw json without building anything; each returns the index
+  // just past what it skipped, or npos if the text ends first
+
+  constexpr auto npos = std::string_view::npos;
+
+  inline size_t skip_space(std::string_view text, size_t i) {
+    while (i < text.size() && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n'))
+      i++;
+
+    return i;
+  }
+
+  // from the opening quote at i; a quote ends the string unless an odd
+  // number of backslashes comes before it
+  inline size_t skip_string(std::string_view text, size_t i) {
+    while (!0) {
+      i = text.find('"', i + 1);
+
+      if (i == npos)
+        return npos;
+
+      auto back = i;
+
+      while (text[back - 1] == '\\')
+        back--;
+
+      if ((i - back) % 2 == 0)
+        return i + 1;
+    }
+  }
+
+  inline size_t skip_value(std::string_view text, size_t i) {
+    if (i >= text.size())
+      return npos;
+
+    if (text[i] == '"')
+      return skip_string(text, i);
+
+    // numbers, true, false and null
+    if (text[i] != '{' && text[i] != '[')
+      return std::min(text.find_first_of(",}] \t\r\n", i), text.size());
+
+    auto depth = 0;
+
+    while (i < text.size()) {
+      switch (text[i]) {
+        case '"':
+          i = skip_string(text, i);
+
+          if (i == npos)
+            return npos;
+
+          continue;
+
+        case '{':
+        case '[':
+          depth++;
+          break;
+
+        case '}':
+        case ']':
+          if (--depth == 0)
+            return i + 1;
+
+          break;
+      }
+
+      i++;
+    }
+
+    return npos;
+  }
+
+  // Pulls op, s and t out of a gateway message in one pass over the text,
+  // without building anything, and leaves d as raw json for whoever wants
+  // to parse() it. Discord puts d after the other three, in which case the
+  // scan stops at d's first byte and only data() goes looking for its end.
+
+  class Envelope {
+    private:
+      std::string_view d;
+      bool trimmed = !1;
+      bool good = !1;
+
+      static std::optional<int64_t> integer(std::string_view text) {
+        auto out = int64_t();
+        auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), out);
+
+        if (err != std::errc() || end != text.data() + text.size())
+          return {};
+
+        return out;
+      }
+
+      bool scan(std::string_view text) {
+        auto seen = 0;
+        auto i = skip_space(text, 0);
+
+        if (i >= text.size() || text[i] != '{')
+          return !1;
+
+        i = skip_space(text, i + 1);
+
+        if (i < text.size() && text[i] == '}')
+          return !0;
+
+        while (!0) {
+          if (i >= text.size() || text[i] != '"')
+            return !1;
+
+          auto end = skip_string(text, i);
+
+          if (end == npos)
+            return !1;
+
+          auto key = text.substr(i + 1, end - i - 2);
+
+          i = skip_space(text, end);
+
+          if (i >= text.size() || text[i] != ':')
+            return !1;
+
+          i = skip_space(text, i + 1);
+
+          // everything else is known, so d's end can wait
+          if (key == "d" && seen == 7) {
+            d = text.substr(i);
+            return !0;
+          }
+
+          auto start = i;
+
+          i = skip_value(text, i);
+
+          if (i == npos)
+            return !1;
+
+          auto value = text.substr(start, i - start);
+
+          if (key == "op") {
+            op = integer(value);
+            seen |= 1;
+          }
+
+          else if (key == "s") {
+            s = integer(value);
+            seen |= 2;
+          }
+
+          else if (key == "t") {
+            if (value.size() > 1 && value.front() == '"')
+              t = value.substr(1, value.size() - 2);
+
+            seen |= 4;
+          }
+
+          else if (key == "d") {
+            d = value;
+            trimmed = !0;
+          }
+
+          i = skip_space(text, i);
+
+          if (i < text.size() && text[i] == ',') {
+            i = skip_space(text, i + 1);
+            continue;
+          }
+
+          return i < text.size() && text[i] == '}';
+        }
+      }
+
+    public:
+      std::optional<int64_t> op;
+      std::optional<int64_t> s;
+      std::string_view t; // empty when null
+
+      // views into text, which has to outlive the envelope
+      Envelope(std::string_view text) {
+        good = scan(text);
+      }
+
+      // whether text was an object the scan could make sense of
+      bool valid() {
+        return good;
+      }
+
+      // d's raw json, empty if there wasn't one
+      std::string_view data() {
+        if (trimmed)
+          return d;
+
+        auto end = skip_value(d, 0);
+
+        d = end == npos ? std::string_view() : d.substr(0, end);
+        trimmed = !0;
+
+        return d;
+      }
+
+      // d parsed, null if there wasn't one
+      obj parse() {
+        auto text = data();
+        return text.empty() ? obj(nullptr) : ptyps::json::parse(text);
+      }
+  };
+}
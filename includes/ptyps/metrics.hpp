@@ -0,0 +1,95 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+namespace ptyps::metrics {
+  // Lock free histogram of non-negative samples (durations, sizes). Values
+  // are bucketed by power of two and each power is split into 16 linear
+  // steps, so anything read back is within ~6% of what was recorded.
+
+  class Histogram {
+    private:
+      static constexpr int STEPS = 16;
+
+      std::array<std::atomic<uint64_t>, 64 * STEPS> buckets = {};
+      std::atomic<uint64_t> samples = 0;
+      std::atomic<uint64_t> total = 0;
+      std::atomic<uint64_t> highest = 0;
+
+      static size_t index(uint64_t value) {
+        if (value < STEPS)
+          return value;
+
+        auto top = 63 - __builtin_clzll(value);
+
+        return (top - 3) * STEPS + ((value >> (top - 4)) & (STEPS - 1));
+      }
+
+      // smallest value that lands in bucket i
+      static uint64_t lower(size_t i) {
+        if (i < STEPS)
+          return i;
+
+        auto top = i / STEPS + 3;
+
+        return (STEPS + (i % STEPS)) << (top - 4);
+      }
+
+    public:
+      void record(uint64_t value) {
+        buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+        samples.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(value, std::memory_order_relaxed);
+
+        auto high = highest.load(std::memory_order_relaxed);
+
+        while (value > high && !highest.compare_exchange_weak(high, value, std::memory_order_relaxed));
+      }
+
+      uint64_t count() const {
+        return samples.load(std::memory_order_relaxed);
+      }
+
+      uint64_t max() const {
+        return highest.load(std::memory_order_relaxed);
+      }
+
+      uint64_t mean() const {
+        auto n = count();
+        return n ? total.load(std::memory_order_relaxed) / n : 0;
+      }
+
+      // p is in the range [0, 100]
+      uint64_t percentile(double p) const {
+        auto n = count();
+
+        if (!n)
+          return 0;
+
+        auto want = uint64_t(n * p / 100.0);
+        auto seen = uint64_t(0);
+
+        for (auto i = size_t(0); i < buckets.size(); i++) {
+          seen += buckets[i].load(std::memory_order_relaxed);
+
+          if (seen > want)
+            return lower(i);
+        }
+
+        return max();
+      }
+
+      void reset() {
+        for (auto &next : buckets)
+          next.store(0, std::memory_order_relaxed);
+
+        samples = 0;
+        total = 0;
+        highest = 0;
+      }
+  };
+}
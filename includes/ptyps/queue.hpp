@@ -0,0 +1,66 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <optional>
+#include <atomic>
+
+namespace ptyps::queue {
+  // Unbounded lock free queue for many producers and a single consumer
+  // (Dmitry Vyukov's node based design). push() is wait free; pop() and
+  // empty() may only be called from the consumer's thread. A push that's
+  // still in progress can be invisible to the consumer for a moment, so
+  // producers should wake the consumer after pushing, not before.
+
+  template <typename T>
+    class Mpsc {
+      private:
+        struct node {
+          std::atomic<node*> next = nullptr;
+          std::optional<T> value;
+        };
+
+        std::atomic<node*> head;
+        node* tail;
+
+      public:
+        Mpsc() {
+          tail = new node();
+          head = tail;
+        }
+
+        Mpsc(const Mpsc &) = delete;
+        Mpsc &operator=(const Mpsc &) = delete;
+
+        ~Mpsc() {
+          while (pop());
+          delete tail;
+        }
+
+        void push(T value) {
+          auto next = new node();
+          next->value = std::move(value);
+
+          auto prev = head.exchange(next, std::memory_order_acq_rel);
+          prev->next.store(next, std::memory_order_release);
+        }
+
+        std::optional<T> pop() {
+          auto next = tail->next.load(std::memory_order_acquire);
+
+          if (!next)
+            return {};
+
+          auto out = std::move(next->value);
+
+          delete tail;
+          tail = next;
+
+          return out;
+        }
+
+        bool empty() {
+          return tail->next.load(std::memory_order_acquire) == nullptr;
+        }
+    };
+}
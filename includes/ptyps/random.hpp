@@ -2,11 +2,19 @@
 
 // Copyright (C) 2022 Dave Perry (dbdii407)
 
+#include <sys/random.h>
+
 #include <cstdint>
+#include <cerrno>
 #include <random>
 #include <string>
+#include <vector>
+
+#include "./error.hpp"
 
 namespace ptyps::random {
+  using exception = ptyps::err::exception;
+
   static auto engine = std::default_random_engine(std::random_device{}()); 
 
   inline uint number(uint start, uint end) {
@@ -14,6 +22,35 @@ namespace ptyps::random {
     return distro(engine);
   }
 
+  // per-thread random words, fetched from the kernel a batch at a time so
+  // callers that only want a few bytes don't make a syscall each. they're
+  // unpredictable, as websocket masking keys have to be (RFC 6455 5.3),
+  // where a seeded engine's output gives its state away
+  inline uint32_t word() {
+    thread_local uint32_t batch[64];
+    thread_local size_t left = 0;
+
+    if (!left) {
+      auto bytes = (char *) batch;
+      auto got = size_t(0);
+
+      while (got < sizeof(batch)) {
+        auto i = ::getrandom(bytes + got, sizeof(batch) - got, 0);
+
+        if (i > 0)
+          got += i;
+
+        // anything but a signal (ENOSYS, EFAULT) will only happen again
+        else if (i < 0 && errno != EINTR)
+          throw exception("unable to get random bytes");
+      }
+
+      left = std::size(batch);
+    }
+
+    return batch[--left];
+  }
+
   inline std::string string(uint length, std::vector<char> charlist) {
     auto out = std::string();
 
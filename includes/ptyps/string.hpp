@@ -2,12 +2,25 @@
 
 // Copyright (C) 2022 Dave Perry (dbdii407)
 
+#include <string_view>
 #include <functional>
+#include <cstdint>
 #include <string>
 
 #include "./iter.hpp"
 
 namespace ptyps::string {
+  // 32 bit FNV-1a, usable at compile time; a different basis gives a
+  // different (but just as good) spread
+  constexpr uint32_t hash(std::string_view text, uint32_t basis = 2166136261u) {
+    for (auto next : text) {
+      basis ^= uint8_t(next);
+      basis *= 16777619u;
+    }
+
+    return basis;
+  }
+
   template <typename ...A>
     std::string format(std::string_view form, A ...args) {
       auto length = std::snprintf(nullptr, 0, &form[0], args...);
@@ -0,0 +1,921 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <algorithm>
+#include <optional>
+#include <shared_mutex>
+#include <charconv>
+#include <bitset>
+#include <array>
+
+#include "../flat.hpp"
+#include "./discord.hpp"
+
+// Guilds, channels, roles, members and users as the gateway tells us
+// about them, kept in small structs rather than the json they came in.
+// Everything's keyed by snowflake in flat::Maps, names are interned (a
+// server's worth of "general" channels is one string), and so are
+// members' role lists and channels' overwrites, which most share with
+// someone else. What a member costs comes to a few tens of bytes.
+
+namespace ptyps::web::cache {
+  using snowflake = uint64_t;
+  using event = ptyps::web::discord::event;
+
+  // what there is to keep; members need GUILD_MEMBERS in the intents to
+  // come with GUILD_CREATE, otherwise only those seen since are kept
+  enum class kind : uint8_t {
+    GUILDS,
+    CHANNELS,
+    ROLES,
+    MEMBERS,
+    USERS
+  };
+
+  using kinds = ptyps::flat::Flags<kind>;
+
+  inline const kinds everything = {kind::GUILDS, kind::CHANNELS, kind::ROLES, kind::MEMBERS, kind::USERS};
+
+  // permission bits, the rest are as discord numbers them
+  constexpr int ADMINISTRATOR = 3;
+
+  // an icon or avatar hash, 32 hex digits
+  using asset = std::array<uint8_t, 16>;
+
+  // -----
+
+  // Values stored once however many times they're used, by a number that
+  // stays the same as long as anyone has it. 0 is always the empty value.
+  // Each add() is owed a release() once whoever made it is done with it.
+  // The index is keyed by hash; the rare value whose hash is taken goes in
+  // the next key along, and release() pulls such values back as it frees.
+
+  template <typename T, typename K = T, typename H = std::hash<K>>
+    class Interner {
+      private:
+        std::vector<T> values = {T()};
+        std::vector<uint32_t> counts = {0};
+        std::vector<uint32_t> spare;
+        ptyps::flat::Map<uint32_t> index;
+
+        // 0 is a free slot to the index
+        static uint64_t key(const K &value) {
+          return H()(value) | 1;
+        }
+
+      public:
+        uint32_t add(const K &value) {
+          if (value == K())
+            return 0;
+
+          auto at = key(value);
+
+          for (auto found = index.find(at); found; found = index.find(at += 2)) {
+            if (values[*found] == value) {
+              counts[*found]++;
+              return *found;
+            }
+          }
+
+          auto id = uint32_t(values.size());
+
+          if (spare.size()) {
+            id = spare.back();
+            spare.pop_back();
+
+            values[id] = T(value);
+            counts[id] = 1;
+          }
+
+          else {
+            values.emplace_back(value);
+            counts.push_back(1);
+          }
+
+          index[at] = id;
+
+          return id;
+        }
+
+        void release(uint32_t id) {
+          if (!id || --counts[id])
+            return;
+
+          auto at = key(K(values[id]));
+
+          while (*index.find(at) != id)
+            at += 2;
+
+          // anything further along that wanted a key at or before this one
+          for (auto next = at + 2; index.find(next); next += 2) {
+            auto moved = *index.find(next);
+
+            if (next - key(K(values[moved])) < next - at)
+              continue;
+
+            index[at] = moved;
+            at = next;
+          }
+
+          index.erase(at);
+
+          values[id] = T();
+          spare.push_back(id);
+        }
+
+        // good until the next add()
+        const T &get(uint32_t id) const {
+          return values[id];
+        }
+
+        // values stored, not counting the empty one or spare slots
+        size_t size() const {
+          return values.size() - 1 - spare.size();
+        }
+
+        // bytes taken, with what the values hold
+        size_t memory() const {
+          auto out = values.capacity() * (sizeof(T) + sizeof(uint32_t)) + index.memory();
+
+          for (auto &next : values) {
+            if constexpr (std::is_same_v<T, std::string>)
+              out += next.capacity() > 15 ? next.capacity() + 1 : 0;
+
+            else
+              out += next.capacity() * sizeof(typename T::value_type);
+          }
+
+          return out;
+        }
+    };
+
+  struct overwrite {
+    public:
+      snowflake id = 0;
+      std::bitset<64> allow;
+      std::bitset<64> deny;
+      uint8_t type = 0; // 0 a role, 1 a member
+
+      bool operator==(const overwrite &) const = default;
+  };
+
+  // hashes a list element by element, which std::hash won't do
+  template <typename T>
+    struct list_hash {
+      public:
+        size_t operator()(const std::vector<T> &list) const {
+          auto out = size_t(0xcbf29ce484222325ull);
+
+          auto mix = [&](uint64_t value) {
+            out = (out ^ value) * 0x100000001b3ull;
+          };
+
+          for (auto &next : list) {
+            if constexpr (std::is_same_v<T, overwrite>) {
+              mix(next.id);
+              mix(next.allow.to_ullong());
+              mix(next.deny.to_ullong());
+              mix(next.type);
+            }
+
+            else
+              mix(next);
+          }
+
+          return out;
+        }
+    };
+
+  // -----
+
+  // interned ids are for Cache::text(), roles() and overwrites()
+
+  enum class user_flag : uint8_t {
+    BOT,
+    SYSTEM,
+    AVATAR, // there is one
+    ANIMATED
+  };
+
+  struct user {
+    public:
+      uint32_t username = 0;
+      uint32_t global = 0; // global_name
+      asset avatar = {};
+      uint16_t discriminator = 0;
+      ptyps::flat::Flags<user_flag> flags;
+  };
+
+  enum class member_flag : uint8_t {
+    DEAF,
+    MUTE,
+    PENDING
+  };
+
+  struct member {
+    public:
+      uint32_t nick = 0;
+      uint32_t roles = 0;
+      uint32_t joined = 0; // unix time
+      ptyps::flat::Flags<member_flag> flags;
+  };
+
+  enum class role_flag : uint8_t {
+    HOIST,
+    MANAGED,
+    MENTIONABLE
+  };
+
+  struct role {
+    public:
+      snowflake guild = 0;
+      std::bitset<64> permissions;
+      uint32_t name = 0;
+      uint32_t color = 0;
+      int16_t position = 0;
+      ptyps::flat::Flags<role_flag> flags;
+  };
+
+  enum class channel_flag : uint8_t {
+    NSFW
+  };
+
+  struct channel {
+    public:
+      snowflake guild = 0;
+      snowflake parent = 0;
+      uint32_t name = 0;
+      uint32_t overwrites = 0;
+      int16_t position = 0;
+      uint8_t type = 0;
+      ptyps::flat::Flags<channel_flag> flags;
+  };
+
+  enum class guild_flag : uint8_t {
+    UNAVAILABLE,
+    LARGE,
+    ICON,
+    ANIMATED
+  };
+
+  struct guild {
+    public:
+      snowflake owner = 0;
+      asset icon = {};
+      uint32_t name = 0;
+      uint32_t count = 0; // member_count
+      ptyps::flat::Flags<guild_flag> flags;
+  };
+
+  // what's kept and roughly what it takes
+  struct usage {
+    public:
+      size_t guilds = 0;
+      size_t channels = 0;
+      size_t roles = 0;
+      size_t members = 0;
+      size_t users = 0;
+      size_t strings = 0;
+      size_t bytes = 0;
+  };
+
+  // -----
+
+  // reading what dispatches bring without json::value's copies
+
+  using field = const ptyps::json::obj *;
+
+  inline field get(const ptyps::json::obj &o, std::string_view key) {
+    if (!o.is_object())
+      return nullptr;
+
+    return o.as_object().if_contains(boost::json::string_view(key.data(), key.size()));
+  }
+
+  inline std::string_view text(field f) {
+    if (!f || !f->is_string())
+      return {};
+
+    auto &s = f->get_string();
+    return std::string_view(s.data(), s.size());
+  }
+
+  inline int64_t integer(field f) {
+    if (!f)
+      return 0;
+
+    if (f->is_int64())
+      return f->get_int64();
+
+    if (f->is_uint64())
+      return f->get_uint64();
+
+    return 0;
+  }
+
+  inline bool flag(field f) {
+    return f && f->is_bool() && f->get_bool();
+  }
+
+  // strings in json, integers in etf
+  inline snowflake id(field f) {
+    if (!f)
+      return 0;
+
+    if (f->is_uint64())
+      return f->get_uint64();
+
+    if (f->is_int64())
+      return f->get_int64();
+
+    auto t = text(f);
+    auto out = snowflake(0);
+
+    std::from_chars(t.data(), t.data() + t.size(), out);
+
+    return out;
+  }
+
+  // hex digits, with a_ in front if it's animated
+  inline bool hash(field f, asset &out, bool &animated) {
+    auto t = text(f);
+
+    animated = t.starts_with("a_");
+
+    if (animated)
+      t.remove_prefix(2);
+
+    if (t.size() != out.size() * 2)
+      return !1;
+
+    for (auto i = size_t(0); i < out.size(); i++) {
+      auto [end, err] = std::from_chars(t.data() + i * 2, t.data() + i * 2 + 2, out[i], 16);
+
+      if (err != std::errc())
+        return !1;
+    }
+
+    return !0;
+  }
+
+  // an ISO 8601 time such as joined_at, which discord always gives in UTC
+  inline uint32_t timestamp(field f) {
+    auto t = text(f);
+
+    if (t.size() < 19)
+      return 0;
+
+    auto number = [&](size_t at, size_t size) {
+      auto out = 0;
+      std::from_chars(t.data() + at, t.data() + at + size, out);
+      return out;
+    };
+
+    auto y = number(0, 4), m = number(5, 2), d = number(8, 2);
+
+    // days since 1970 (Howard Hinnant's days_from_civil)
+    y -= m <= 2;
+
+    auto era = y / 400;
+    auto yoe = y - era * 400;
+    auto doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    auto days = int64_t(era) * 146097 + doe - 719468;
+
+    return uint32_t(days * 86400 + number(11, 2) * 3600 + number(14, 2) * 60 + number(17, 2));
+  }
+
+  // -----
+
+  // Fed by the dispatches of the Gateway or ShardManager it's attached to,
+  // which it has to be before they connect. Shards on different io threads
+  // update it at once, so everything's behind a lock that readers share;
+  // what comes out is a copy, as the maps move things around as they grow.
+
+  class Cache {
+    private:
+      kinds which;
+
+      mutable std::shared_mutex lock;
+
+      ptyps::flat::Map<cache::guild> guilds;
+      ptyps::flat::Map<cache::channel> channels;
+      ptyps::flat::Map<cache::role> roles_;
+      ptyps::flat::Map<ptyps::flat::Map<cache::member>> members;
+      ptyps::flat::Map<cache::user> users;
+
+      Interner<std::string, std::string_view> strings;
+      Interner<std::vector<snowflake>, std::vector<snowflake>, list_hash<snowflake>> lists;
+      Interner<std::vector<overwrite>, std::vector<overwrite>, list_hash<overwrite>> permits;
+
+      snowflake self = 0;
+
+      // what each event's d is needed for
+      std::vector<event> events() {
+        auto out = std::vector<event>({event::READY, event::USER_UPDATE});
+
+        if (which.test(kind::GUILDS) || which.test(kind::CHANNELS) || which.test(kind::ROLES) || which.test(kind::MEMBERS) || which.test(kind::USERS))
+          out.insert(out.end(), {event::GUILD_CREATE, event::GUILD_UPDATE, event::GUILD_DELETE});
+
+        if (which.test(kind::CHANNELS))
+          out.insert(out.end(), {event::CHANNEL_CREATE, event::CHANNEL_UPDATE, event::CHANNEL_DELETE, event::THREAD_CREATE, event::THREAD_UPDATE, event::THREAD_DELETE});
+
+        if (which.test(kind::ROLES))
+          out.insert(out.end(), {event::GUILD_ROLE_CREATE, event::GUILD_ROLE_UPDATE, event::GUILD_ROLE_DELETE});
+
+        if (which.test(kind::MEMBERS) || which.test(kind::USERS))
+          out.insert(out.end(), {event::GUILD_MEMBER_ADD, event::GUILD_MEMBER_UPDATE, event::GUILD_MEMBER_REMOVE, event::GUILD_MEMBERS_CHUNK});
+
+        return out;
+      }
+
+      // -----
+
+      // what each holds of the interned tables goes back before it's
+      // replaced or erased
+
+      void release(const cache::guild &g) {
+        strings.release(g.name);
+      }
+
+      void release(const cache::channel &c) {
+        strings.release(c.name);
+        permits.release(c.overwrites);
+      }
+
+      void release(const cache::role &r) {
+        strings.release(r.name);
+      }
+
+      void release(const cache::member &m) {
+        strings.release(m.nick);
+        lists.release(m.roles);
+      }
+
+      void release(const cache::user &u) {
+        strings.release(u.username);
+        strings.release(u.global);
+      }
+
+      template <typename T>
+        void replace(ptyps::flat::Map<T> &map, snowflake key, T value) {
+          auto &slot = map[key];
+
+          release(slot);
+          slot = value;
+        }
+
+      template <typename T>
+        void remove(ptyps::flat::Map<T> &map, snowflake key) {
+          if (auto found = map.find(key))
+            release(*found);
+
+          map.erase(key);
+        }
+
+      // -----
+
+      void put_user(const ptyps::json::obj &d) {
+        auto key = id(get(d, "id"));
+
+        if (!key || !which.test(kind::USERS))
+          return;
+
+        auto u = cache::user();
+        auto animated = !1;
+
+        u.username = strings.add(cache::text(get(d, "username")));
+        u.global = strings.add(cache::text(get(d, "global_name")));
+
+        auto discriminator = cache::text(get(d, "discriminator"));
+        std::from_chars(discriminator.data(), discriminator.data() + discriminator.size(), u.discriminator);
+
+        u.flags.set(user_flag::AVATAR, hash(get(d, "avatar"), u.avatar, animated));
+        u.flags.set(user_flag::ANIMATED, animated);
+        u.flags.set(user_flag::BOT, flag(get(d, "bot")));
+        u.flags.set(user_flag::SYSTEM, flag(get(d, "system")));
+
+        replace(users, key, u);
+      }
+
+      // d is a guild member, with its user unless user's given
+      void put_member(snowflake guild, const ptyps::json::obj &d, snowflake user = 0) {
+        auto person = get(d, "user");
+
+        if (person)
+          put_user(*person);
+
+        if (!user)
+          user = id(person ? get(*person, "id") : nullptr);
+
+        if (!guild || !user || !which.test(kind::MEMBERS))
+          return;
+
+        auto m = cache::member();
+        auto list = std::vector<snowflake>();
+
+        if (auto found = get(d, "roles"); found && found->is_array()) {
+          for (auto &next : found->get_array())
+            list.push_back(id(&next));
+
+          std::sort(list.begin(), list.end());
+        }
+
+        m.nick = strings.add(cache::text(get(d, "nick")));
+        m.roles = lists.add(list);
+        m.joined = timestamp(get(d, "joined_at"));
+
+        m.flags.set(member_flag::DEAF, flag(get(d, "deaf")));
+        m.flags.set(member_flag::MUTE, flag(get(d, "mute")));
+        m.flags.set(member_flag::PENDING, flag(get(d, "pending")));
+
+        replace(members[guild], user, m);
+      }
+
+      void put_role(snowflake guild, const ptyps::json::obj &d) {
+        auto key = id(get(d, "id"));
+
+        if (!key || !which.test(kind::ROLES))
+          return;
+
+        auto r = cache::role();
+
+        r.guild = guild;
+        r.name = strings.add(cache::text(get(d, "name")));
+        r.color = integer(get(d, "color"));
+        r.position = integer(get(d, "position"));
+        r.permissions = id(get(d, "permissions"));
+
+        r.flags.set(role_flag::HOIST, flag(get(d, "hoist")));
+        r.flags.set(role_flag::MANAGED, flag(get(d, "managed")));
+        r.flags.set(role_flag::MENTIONABLE, flag(get(d, "mentionable")));
+
+        replace(roles_, key, r);
+      }
+
+      void put_channel(snowflake guild, const ptyps::json::obj &d) {
+        auto key = id(get(d, "id"));
+
+        if (!key || !which.test(kind::CHANNELS))
+          return;
+
+        auto c = cache::channel();
+        auto list = std::vector<overwrite>();
+
+        if (auto found = get(d, "permission_overwrites"); found && found->is_array()) {
+          for (auto &next : found->get_array()) {
+            auto o = overwrite();
+
+            o.id = id(get(next, "id"));
+            o.type = integer(get(next, "type"));
+            o.allow = id(get(next, "allow"));
+            o.deny = id(get(next, "deny"));
+
+            list.push_back(o);
+          }
+        }
+
+        c.guild = guild ? guild : id(get(d, "guild_id"));
+        c.parent = id(get(d, "parent_id"));
+        c.name = strings.add(cache::text(get(d, "name")));
+        c.overwrites = permits.add(list);
+        c.position = integer(get(d, "position"));
+        c.type = integer(get(d, "type"));
+
+        c.flags.set(channel_flag::NSFW, flag(get(d, "nsfw")));
+
+        replace(channels, key, c);
+      }
+
+      void put_guild(const ptyps::json::obj &d) {
+        auto key = id(get(d, "id"));
+
+        if (!key)
+          return;
+
+        if (which.test(kind::GUILDS)) {
+          auto g = cache::guild();
+          auto animated = !1;
+
+          // GUILD_UPDATE doesn't have member_count
+          if (auto found = guilds.find(key))
+            g.count = found->count;
+
+          if (auto found = get(d, "member_count"))
+            g.count = integer(found);
+
+          g.name = strings.add(cache::text(get(d, "name")));
+          g.owner = id(get(d, "owner_id"));
+
+          g.flags.set(guild_flag::ICON, hash(get(d, "icon"), g.icon, animated));
+          g.flags.set(guild_flag::ANIMATED, animated);
+          g.flags.set(guild_flag::LARGE, flag(get(d, "large")));
+          g.flags.set(guild_flag::UNAVAILABLE, flag(get(d, "unavailable")));
+
+          replace(guilds, key, g);
+        }
+
+        auto each = [&](std::string_view name, auto func) {
+          if (auto found = get(d, name); found && found->is_array())
+            for (auto &next : found->get_array())
+              func(next);
+        };
+
+        each("roles", [&](const ptyps::json::obj &next) {
+          put_role(key, next);
+        });
+
+        each("channels", [&](const ptyps::json::obj &next) {
+          put_channel(key, next);
+        });
+
+        each("threads", [&](const ptyps::json::obj &next) {
+          put_channel(key, next);
+        });
+
+        if (auto found = get(d, "members"); found && found->is_array()) {
+          if (which.test(kind::MEMBERS))
+            members[key].reserve(members[key].size() + found->get_array().size());
+
+          for (auto &next : found->get_array())
+            put_member(key, next);
+        }
+      }
+
+      // left, kicked or deleted, everything in it goes
+      void drop_guild(snowflake key) {
+        remove(guilds, key);
+
+        channels.erase_if([&](snowflake, cache::channel &c) {
+          if (c.guild == key)
+            release(c);
+
+          return c.guild == key;
+        });
+
+        roles_.erase_if([&](snowflake, cache::role &r) {
+          if (r.guild == key)
+            release(r);
+
+          return r.guild == key;
+        });
+
+        if (auto found = members.find(key))
+          found->each([&](snowflake, cache::member &m) {
+            release(m);
+          });
+
+        members.erase(key);
+      }
+
+      std::bitset<64> base(snowflake guild, const cache::member &m) const {
+        auto out = std::bitset<64>();
+
+        // @everyone's id is the guild's
+        if (auto everyone = roles_.find(guild))
+          out |= everyone->permissions;
+
+        for (auto next : lists.get(m.roles))
+          if (auto found = roles_.find(next))
+            out |= found->permissions;
+
+        return out;
+      }
+
+    public:
+      Cache(kinds which = everything) : which(which) {
+
+      }
+
+      Cache(const Cache &) = delete;
+
+      // feeds this from gateway's dispatches, before it connects
+      void attach(ptyps::web::discord::Gateway &gateway) {
+        for (auto next : events())
+          gateway.on(next, [this, next](const ptyps::web::discord::Payload &data) {
+            update(next, data.json());
+          });
+      }
+
+      void attach(ptyps::web::discord::ShardManager &shards) {
+        for (auto next : events())
+          shards.on(next, [this, next](int shard, const ptyps::web::discord::Payload &data) {
+            update(next, data.json());
+          });
+      }
+
+      // applies one dispatch's d, for whatever doesn't come through attach()
+      void update(event kind, const ptyps::json::obj &d) {
+        auto guard = std::unique_lock(lock);
+
+        auto guild = id(get(d, "guild_id"));
+
+        switch (kind) {
+          case event::READY:
+            if (auto found = get(d, "user")) {
+              self = id(get(*found, "id"));
+              put_user(*found);
+            }
+
+            break;
+
+          case event::USER_UPDATE:
+            put_user(d);
+            break;
+
+          case event::GUILD_CREATE:
+          case event::GUILD_UPDATE:
+            put_guild(d);
+            break;
+
+          // an outage only makes it unavailable for now
+          case event::GUILD_DELETE:
+            if (!flag(get(d, "unavailable")))
+              drop_guild(id(get(d, "id")));
+
+            else if (auto found = guilds.find(id(get(d, "id"))))
+              found->flags.set(guild_flag::UNAVAILABLE);
+
+            break;
+
+          case event::CHANNEL_CREATE:
+          case event::CHANNEL_UPDATE:
+          case event::THREAD_CREATE:
+          case event::THREAD_UPDATE:
+            put_channel(guild, d);
+            break;
+
+          case event::CHANNEL_DELETE:
+          case event::THREAD_DELETE:
+            remove(channels, id(get(d, "id")));
+            break;
+
+          case event::GUILD_ROLE_CREATE:
+          case event::GUILD_ROLE_UPDATE:
+            if (auto found = get(d, "role"))
+              put_role(guild, *found);
+
+            break;
+
+          case event::GUILD_ROLE_DELETE:
+            remove(roles_, id(get(d, "role_id")));
+            break;
+
+          case event::GUILD_MEMBER_ADD:
+          case event::GUILD_MEMBER_UPDATE:
+            put_member(guild, d);
+            break;
+
+          case event::GUILD_MEMBER_REMOVE:
+            if (auto found = members.find(guild); found && get(d, "user"))
+              remove(*found, id(get(*get(d, "user"), "id")));
+
+            break;
+
+          case event::GUILD_MEMBERS_CHUNK:
+            if (auto found = get(d, "members"); found && found->is_array())
+              for (auto &next : found->get_array())
+                put_member(guild, next);
+
+            break;
+
+          default:
+            break;
+        }
+      }
+
+      // -----
+
+      std::optional<cache::guild> guild(snowflake key) const {
+        auto guard = std::shared_lock(lock);
+        auto found = guilds.find(key);
+
+        return found ? std::optional(*found) : std::nullopt;
+      }
+
+      std::optional<cache::channel> channel(snowflake key) const {
+        auto guard = std::shared_lock(lock);
+        auto found = channels.find(key);
+
+        return found ? std::optional(*found) : std::nullopt;
+      }
+
+      std::optional<cache::role> role(snowflake key) const {
+        auto guard = std::shared_lock(lock);
+        auto found = roles_.find(key);
+
+        return found ? std::optional(*found) : std::nullopt;
+      }
+
+      std::optional<cache::member> member(snowflake guild, snowflake user) const {
+        auto guard = std::shared_lock(lock);
+        auto list = members.find(guild);
+        auto found = list ? list->find(user) : nullptr;
+
+        return found ? std::optional(*found) : std::nullopt;
+      }
+
+      std::optional<cache::user> user(snowflake key) const {
+        auto guard = std::shared_lock(lock);
+        auto found = users.find(key);
+
+        return found ? std::optional(*found) : std::nullopt;
+      }
+
+      // the bot's own user, from READY
+      snowflake me() const {
+        auto guard = std::shared_lock(lock);
+        return self;
+      }
+
+      // an interned name or nick
+      std::string text(uint32_t id) const {
+        auto guard = std::shared_lock(lock);
+        return strings.get(id);
+      }
+
+      // a member's role ids, sorted
+      std::vector<snowflake> roles(const cache::member &m) const {
+        auto guard = std::shared_lock(lock);
+        return lists.get(m.roles);
+      }
+
+      std::vector<overwrite> overwrites(const cache::channel &c) const {
+        auto guard = std::shared_lock(lock);
+        return permits.get(c.overwrites);
+      }
+
+      // what user can do in guild, or in one of its channels with its
+      // overwrites applied; needs roles and members (and channels) cached
+      std::optional<std::bitset<64>> permissions(snowflake guild, snowflake user, snowflake channel = 0) const {
+        auto guard = std::shared_lock(lock);
+        auto list = members.find(guild);
+        auto m = list ? list->find(user) : nullptr;
+        auto g = guilds.find(guild);
+
+        if (!m)
+          return {};
+
+        auto all = std::bitset<64>().set();
+
+        if (g && g->owner == user)
+          return all;
+
+        auto out = base(guild, *m);
+
+        if (out.test(ADMINISTRATOR) || !channel)
+          return out.test(ADMINISTRATOR) ? all : out;
+
+        auto c = channels.find(channel);
+
+        if (!c)
+          return out;
+
+        auto &mine = lists.get(m->roles);
+        auto allow = std::bitset<64>(), deny = std::bitset<64>();
+
+        // @everyone's, then the member's roles' together, then the member's
+        for (auto &next : permits.get(c->overwrites))
+          if (next.id == guild)
+            out = (out & ~next.deny) | next.allow;
+
+        for (auto &next : permits.get(c->overwrites)) {
+          if (next.type == 0 && std::binary_search(mine.begin(), mine.end(), next.id)) {
+            allow |= next.allow;
+            deny |= next.deny;
+          }
+        }
+
+        out = (out & ~deny) | allow;
+
+        for (auto &next : permits.get(c->overwrites))
+          if (next.type == 1 && next.id == user)
+            out = (out & ~next.deny) | next.allow;
+
+        return out;
+      }
+
+      // counts, and roughly what they take
+      cache::usage usage() const {
+        auto guard = std::shared_lock(lock);
+        auto out = cache::usage();
+
+        out.guilds = guilds.size();
+        out.channels = channels.size();
+        out.roles = roles_.size();
+        out.users = users.size();
+        out.strings = strings.size();
+
+        out.bytes = guilds.memory() + channels.memory() + roles_.memory() + members.memory() + users.memory();
+        out.bytes += strings.memory() + lists.memory() + permits.memory();
+
+        members.each([&](snowflake, const ptyps::flat::Map<cache::member> &list) {
+          out.members += list.size();
+          out.bytes += list.memory();
+        });
+
+        return out;
+      }
+  };
+}
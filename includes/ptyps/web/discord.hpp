@@ -2,7 +2,16 @@
 
 // Copyright (C) 2022 Dave Perry (dbdii407)
 
+#include <bitset>
+#include <deque>
+#include <mutex>
+
 #include "../json.hpp"
+#include "../etf.hpp"
+#include "../metrics.hpp"
+#include "../zlib.hpp"
+#include "../random.hpp"
+#include "./url.hpp"
 #include "./ws.hpp"
 
 namespace ptyps::web::discord {
@@ -20,6 +29,11 @@ namespace ptyps::web::discord {
   constexpr int OP_HELLO = 10;
   constexpr int OP_HEARTBEAT_ACK = 11;
 
+  // the most a zlib-stream message may inflate to unless limit() says
+  // otherwise; the biggest discord sends (READY, a large GUILD_CREATE) are
+  // a few MB, anything near this is a broken or hostile stream
+  constexpr size_t INFLATE_LIMIT = 128 << 20;
+
   enum class opcode {
     DISPATCH = OP_DISPATCH,
     HEARTBEAT = OP_HEARTBEAT,
@@ -34,6 +48,19 @@ namespace ptyps::web::discord {
     HEARTBEAT_ACK = OP_HEARTBEAT_ACK
   };
 
+  constexpr auto API = "https://discord.com/api/v10";
+  constexpr auto GATEWAY = "wss://gateway.discord.gg";
+
+  // where to connect, given the gateway's address from /gateway/bot
+  std::string locate(ptyps::json::obj opts, std::string gateway = GATEWAY) {
+    auto url = gateway + "/?v=9&encoding=" + ptyps::json::value<std::string>(opts, "encoding").value_or("json");
+
+    if (ptyps::json::value<bool>(opts, "compress").value_or(!1))
+      url += "&compress=zlib-stream";
+
+    return url;
+  }
+
   std::string createPacket(opcode op, ptyps::json::obj data) {
     return ptyps::json::stringify({
       {"op", std::underlying_type_t<opcode>(op)},
@@ -41,24 +68,568 @@ namespace ptyps::web::discord {
     });
   }
 
+  // -----
+
+  // Every dispatch the gateway sends, by its t. UNKNOWN is for anything
+  // newer than this list.
+
+  enum class event : uint8_t {
+    UNKNOWN,
+
+    READY,
+    RESUMED,
+
+    APPLICATION_COMMAND_PERMISSIONS_UPDATE,
+
+    AUTO_MODERATION_RULE_CREATE,
+    AUTO_MODERATION_RULE_UPDATE,
+    AUTO_MODERATION_RULE_DELETE,
+    AUTO_MODERATION_ACTION_EXECUTION,
+
+    CHANNEL_CREATE,
+    CHANNEL_UPDATE,
+    CHANNEL_DELETE,
+    CHANNEL_PINS_UPDATE,
+
+    THREAD_CREATE,
+    THREAD_UPDATE,
+    THREAD_DELETE,
+    THREAD_LIST_SYNC,
+    THREAD_MEMBER_UPDATE,
+    THREAD_MEMBERS_UPDATE,
+
+    ENTITLEMENT_CREATE,
+    ENTITLEMENT_UPDATE,
+    ENTITLEMENT_DELETE,
+
+    GUILD_CREATE,
+    GUILD_UPDATE,
+    GUILD_DELETE,
+    GUILD_AUDIT_LOG_ENTRY_CREATE,
+    GUILD_BAN_ADD,
+    GUILD_BAN_REMOVE,
+    GUILD_EMOJIS_UPDATE,
+    GUILD_STICKERS_UPDATE,
+    GUILD_INTEGRATIONS_UPDATE,
+
+    GUILD_MEMBER_ADD,
+    GUILD_MEMBER_REMOVE,
+    GUILD_MEMBER_UPDATE,
+    GUILD_MEMBERS_CHUNK,
+
+    GUILD_ROLE_CREATE,
+    GUILD_ROLE_UPDATE,
+    GUILD_ROLE_DELETE,
+
+    GUILD_SCHEDULED_EVENT_CREATE,
+    GUILD_SCHEDULED_EVENT_UPDATE,
+    GUILD_SCHEDULED_EVENT_DELETE,
+    GUILD_SCHEDULED_EVENT_USER_ADD,
+    GUILD_SCHEDULED_EVENT_USER_REMOVE,
+
+    GUILD_SOUNDBOARD_SOUND_CREATE,
+    GUILD_SOUNDBOARD_SOUND_UPDATE,
+    GUILD_SOUNDBOARD_SOUND_DELETE,
+    GUILD_SOUNDBOARD_SOUNDS_UPDATE,
+    SOUNDBOARD_SOUNDS,
+
+    INTEGRATION_CREATE,
+    INTEGRATION_UPDATE,
+    INTEGRATION_DELETE,
+
+    INTERACTION_CREATE,
+
+    INVITE_CREATE,
+    INVITE_DELETE,
+
+    MESSAGE_CREATE,
+    MESSAGE_UPDATE,
+    MESSAGE_DELETE,
+    MESSAGE_DELETE_BULK,
+
+    MESSAGE_REACTION_ADD,
+    MESSAGE_REACTION_REMOVE,
+    MESSAGE_REACTION_REMOVE_ALL,
+    MESSAGE_REACTION_REMOVE_EMOJI,
+
+    MESSAGE_POLL_VOTE_ADD,
+    MESSAGE_POLL_VOTE_REMOVE,
+
+    PRESENCE_UPDATE,
+
+    STAGE_INSTANCE_CREATE,
+    STAGE_INSTANCE_UPDATE,
+    STAGE_INSTANCE_DELETE,
+
+    SUBSCRIPTION_CREATE,
+    SUBSCRIPTION_UPDATE,
+    SUBSCRIPTION_DELETE,
+
+    TYPING_START,
+    USER_UPDATE,
+
+    VOICE_CHANNEL_EFFECT_SEND,
+    VOICE_STATE_UPDATE,
+    VOICE_SERVER_UPDATE,
+
+    WEBHOOKS_UPDATE
+  };
+
+  // names, in the same order as event
+  constexpr std::string_view events[] = {
+    "",
+
+    "READY",
+    "RESUMED",
+
+    "APPLICATION_COMMAND_PERMISSIONS_UPDATE",
+
+    "AUTO_MODERATION_RULE_CREATE",
+    "AUTO_MODERATION_RULE_UPDATE",
+    "AUTO_MODERATION_RULE_DELETE",
+    "AUTO_MODERATION_ACTION_EXECUTION",
+
+    "CHANNEL_CREATE",
+    "CHANNEL_UPDATE",
+    "CHANNEL_DELETE",
+    "CHANNEL_PINS_UPDATE",
+
+    "THREAD_CREATE",
+    "THREAD_UPDATE",
+    "THREAD_DELETE",
+    "THREAD_LIST_SYNC",
+    "THREAD_MEMBER_UPDATE",
+    "THREAD_MEMBERS_UPDATE",
+
+    "ENTITLEMENT_CREATE",
+    "ENTITLEMENT_UPDATE",
+    "ENTITLEMENT_DELETE",
+
+    "GUILD_CREATE",
+    "GUILD_UPDATE",
+    "GUILD_DELETE",
+    "GUILD_AUDIT_LOG_ENTRY_CREATE",
+    "GUILD_BAN_ADD",
+    "GUILD_BAN_REMOVE",
+    "GUILD_EMOJIS_UPDATE",
+    "GUILD_STICKERS_UPDATE",
+    "GUILD_INTEGRATIONS_UPDATE",
+
+    "GUILD_MEMBER_ADD",
+    "GUILD_MEMBER_REMOVE",
+    "GUILD_MEMBER_UPDATE",
+    "GUILD_MEMBERS_CHUNK",
+
+    "GUILD_ROLE_CREATE",
+    "GUILD_ROLE_UPDATE",
+    "GUILD_ROLE_DELETE",
+
+    "GUILD_SCHEDULED_EVENT_CREATE",
+    "GUILD_SCHEDULED_EVENT_UPDATE",
+    "GUILD_SCHEDULED_EVENT_DELETE",
+    "GUILD_SCHEDULED_EVENT_USER_ADD",
+    "GUILD_SCHEDULED_EVENT_USER_REMOVE",
+
+    "GUILD_SOUNDBOARD_SOUND_CREATE",
+    "GUILD_SOUNDBOARD_SOUND_UPDATE",
+    "GUILD_SOUNDBOARD_SOUND_DELETE",
+    "GUILD_SOUNDBOARD_SOUNDS_UPDATE",
+    "SOUNDBOARD_SOUNDS",
+
+    "INTEGRATION_CREATE",
+    "INTEGRATION_UPDATE",
+    "INTEGRATION_DELETE",
+
+    "INTERACTION_CREATE",
+
+    "INVITE_CREATE",
+    "INVITE_DELETE",
+
+    "MESSAGE_CREATE",
+    "MESSAGE_UPDATE",
+    "MESSAGE_DELETE",
+    "MESSAGE_DELETE_BULK",
+
+    "MESSAGE_REACTION_ADD",
+    "MESSAGE_REACTION_REMOVE",
+    "MESSAGE_REACTION_REMOVE_ALL",
+    "MESSAGE_REACTION_REMOVE_EMOJI",
+
+    "MESSAGE_POLL_VOTE_ADD",
+    "MESSAGE_POLL_VOTE_REMOVE",
+
+    "PRESENCE_UPDATE",
+
+    "STAGE_INSTANCE_CREATE",
+    "STAGE_INSTANCE_UPDATE",
+    "STAGE_INSTANCE_DELETE",
+
+    "SUBSCRIPTION_CREATE",
+    "SUBSCRIPTION_UPDATE",
+    "SUBSCRIPTION_DELETE",
+
+    "TYPING_START",
+    "USER_UPDATE",
+
+    "VOICE_CHANNEL_EFFECT_SEND",
+    "VOICE_STATE_UPDATE",
+    "VOICE_SERVER_UPDATE",
+
+    "WEBHOOKS_UPDATE"
+  };
+
+  static_assert(std::size(events) == size_t(event::WEBHOOKS_UPDATE) + 1);
+
+  // Names are mapped to events with a table that has a slot of its own for
+  // each name, so working out a dispatch's event is one hash, one load and
+  // one compare however many events there are. The hash's basis is searched
+  // for at compile time until no two names share a slot.
+
+  constexpr size_t SLOTS = 1024;
+
+  constexpr size_t slot(std::string_view name, uint32_t basis) {
+    auto hash = ptyps::string::hash(name, basis);
+    return (hash ^ (hash >> 16)) % SLOTS;
+  }
+
+  constexpr uint32_t perfect() {
+    for (auto basis = uint32_t(2166136261u); ; basis++) {
+      bool used[SLOTS] = {};
+      auto clash = !1;
+
+      for (auto i = size_t(1); i < std::size(events) && !clash; i++) {
+        auto at = slot(events[i], basis);
+
+        clash = used[at];
+        used[at] = !0;
+      }
+
+      if (!clash)
+        return basis;
+    }
+  }
+
+  constexpr auto BASIS = perfect();
+
+  constexpr auto slots = []() {
+    auto out = std::array<uint8_t, SLOTS>();
+
+    for (auto i = size_t(1); i < std::size(events); i++)
+      out[slot(events[i], BASIS)] = i;
+
+    return out;
+  }();
+
+  // which event a dispatch's t names
+  constexpr event lookup(std::string_view name) {
+    auto i = slots[slot(name, BASIS)];
+    return events[i] == name ? event(i) : event::UNKNOWN;
+  }
+
+  static_assert(lookup("READY") == event::READY);
+  static_assert(lookup("WEBHOOKS_UPDATE") == event::WEBHOOKS_UPDATE);
+  static_assert(lookup("NOT_AN_EVENT") == event::UNKNOWN);
+
+  // Close codes after which reconnecting won't help (bad token, shard or
+  // intents), and ones after which the session can't be resumed.
+  //
+  // https://discord.com/developers/docs/topics/opcodes-and-status-codes#gateway-gateway-close-event-codes
+
+  constexpr bool fatal(int code) {
+    return code == 4004 || (code >= 4010 && code <= 4014);
+  }
+
+  constexpr bool unresumable(int code) {
+    return code == 4007 || code == 4009;
+  }
+
+  // -----
+
+  // A dispatch's d as handlers get it, whichever encoding it came in.
+  // value<T>() reads a term where it lies, json() only builds a DOM the
+  // first time something asks for one (parsing the text, or converting
+  // the term) and shares it with whoever asks after. It's a view into the
+  // frame, so it only lasts the call.
+
+  class Payload {
+    private:
+      std::string_view text;
+      std::optional<ptyps::etf::Term> term;
+      mutable std::optional<ptyps::json::obj> dom;
+
+    public:
+      Payload(ptyps::json::Envelope &packet) : text(packet.data()) {
+
+      }
+
+      Payload(ptyps::etf::Envelope &packet) : term(packet.term()) {
+
+      }
+
+      Payload(ptyps::json::obj data) : dom(std::move(data)) {
+
+      }
+
+      // the same conversions for either encoding; ids are strings in json
+      // and integers in etf, so uint64_t takes both
+      template <typename T>
+        std::optional<T> value(std::string_view prop) const {
+          if (term)
+            return ptyps::etf::value<T>(*term, prop);
+
+          auto at = &json();
+
+          while (prop.size()) {
+            auto dot = prop.find('.');
+
+            at = at->is_object() ? at->get_object().if_contains(prop.substr(0, dot)) : nullptr;
+
+            if (!at)
+              return {};
+
+            prop = dot == std::string_view::npos ? std::string_view() : prop.substr(dot + 1);
+          }
+
+          if constexpr (std::is_same_v<T, uint64_t>) {
+            if (at->is_string()) {
+              auto &digits = at->get_string();
+              auto out = uint64_t();
+              auto [end, err] = std::from_chars(digits.data(), digits.data() + digits.size(), out);
+
+              if (err != std::errc() || end != digits.data() + digits.size())
+                return {};
+
+              return out;
+            }
+          }
+
+          try {
+            return boost::json::value_to<T>(*at);
+          }
+
+          catch (const std::exception &err) {
+            return {};
+          }
+        }
+
+      // d as it came with encoding=etf, empty with json
+      std::optional<ptyps::etf::Term> etf() const {
+        return term;
+      }
+
+      // d as json, null if there wasn't one
+      const ptyps::json::obj &json() const {
+        if (dom)
+          return *dom;
+
+        if (term)
+          dom = ptyps::etf::to_json(*term);
+
+        else
+          dom = text.empty() ? ptyps::json::obj(nullptr) : ptyps::json::parse(text);
+
+        return *dom;
+      }
+
+      // whether json() has been asked for yet, and so built
+      bool built() const {
+        return dom.has_value();
+      }
+  };
+
+  // Reconnects by itself once connect() has been called, until disconnect()
+  // is. The session from READY is kept, so a dropped connection (or one
+  // the gateway asks to be moved with RECONNECT) picks up where it left off
+  // with RESUME at resume_gateway_url, and only what was missed is sent
+  // again. IDENTIFY is only sent anew when the gateway says the session is
+  // gone.
+
   class Gateway : public ptyps::web::wss::Socket {
     private:
       ptyps::json::obj opts;
-      int last;
+      int last = 0;
+
+      // where IDENTIFYs go, and the query every connection is made with
+      std::string origin;
+      std::string query;
+
+      // from READY, resumable is resume_gateway_url with our query on it;
+      // both are only touched on the io thread
+      std::string session;
+      std::string resumable;
+
+      // RESUME sent, RESUMED not seen yet; what comes before it is replayed
+      std::atomic<bool> resuming = !1;
+      std::atomic<uint64_t> replayed = 0;
+      std::atomic<uint64_t> resumed = 0;
+
+      // reconnects until disconnect(); fails is how many have gone in a
+      // row without getting to READY or RESUMED
+      std::atomic<bool> persistent = !1;
+      std::atomic<uint64_t> reconnector = 0;
+      int fails = 0;
+
+      // [id, count] sent with IDENTIFY, see sharding()
+      std::optional<std::pair<int, int>> shard;
+
+      // the heartbeat timer and which connection it's for, as a stale one
+      // can still fire once after it's cancelled; sent is when the beat
+      // waiting on its ACK went out, empty once it's in
+      uint64_t heartbeat = 0;
+      uint64_t beats = 0;
+      std::optional<std::chrono::steady_clock::time_point> sent;
+
+      // counts connections, so a new one can be told from the last
+      std::atomic<uint64_t> connections = 0;
+
+      // heartbeat to ACK, in microseconds
+      ptyps::metrics::Histogram lag;
+      std::atomic<uint64_t> zombied = 0;
+
+      // what on() registered, by event
+      std::array<std::vector<std::function<void(const Payload &)>>, std::size(events)> handlers;
+      std::bitset<std::size(events)> wanted;
+      std::atomic<uint64_t> skipped = 0;
+      bool raw = !1;
+
+      // encoding=etf in the url, frames are binary terms both ways
+      bool etf = !1;
+
+      // compress=zlib-stream in the url, what comes in is one zlib stream
+      std::unique_ptr<ptyps::zlib::Inflater> inflater;
 
       virtual void gateway_on_disconnect() { }
       virtual void gateway_on_connect() { }
+      virtual void gateway_on_fail(std::string_view why) { }
       virtual void gateway_on_open() { }
       virtual void gateway_on_close() { }
 
-      virtual void gateway_on_ready(ptyps::json::obj data) { }
-      virtual void gateway_on_guild_create(ptyps::json::obj data) { }
+      // HELLO is in and IDENTIFY is next; return false to hold it back and
+      // call identify() once it's allowed to go
+      virtual bool gateway_on_identify() {
+        return !0;
+      }
+
+      // every dispatch, before the more specific handlers below, with d
+      // as raw json to parse() if need be, or a raw term to read with
+      // etf::Term if encoding=etf; only called once dispatches(true)
+      virtual void gateway_on_dispatch(std::string_view event, std::string_view data) { }
+
+      virtual void gateway_on_ready(const Payload &data) { }
+      virtual void gateway_on_guild_create(const Payload &data) { }
+
+      // the session picked up again, everything missed has been replayed
+      virtual void gateway_on_resumed() { }
+
+      // the session's gone and the next connection will IDENTIFY
+      virtual void gateway_on_invalidated() { }
+
+      // a heartbeat went unanswered, the connection's about to be dropped
+      virtual void gateway_on_zombie() { }
+
+      void forget() {
+        session.clear();
+        resumable.clear();
+        last = 0;
+      }
+
+      // connects again after wait, to resume_gateway_url if there's a session
+      // to resume and where we started if not
+      void reconnect(std::chrono::milliseconds wait) {
+        if (!persistent || reconnector)
+          return;
+
+        reconnector = after(wait, [this]() {
+          reconnector = 0;
+
+          if (!persistent)
+            return;
+
+          redirect(session.size() && resumable.size() ? resumable : origin);
+
+          try {
+            ptyps::web::wss::Socket::connect();
+          }
+
+          // not done going yet, it'll be back through here when it is
+          catch (const std::exception &err) {
+
+          }
+        });
+      }
+
+      // straight away the first time, then backing off
+      void reconnect() {
+        if (!persistent || reconnector)
+          return;
+
+        auto wait = std::chrono::milliseconds(0);
+
+        if (fails)
+          wait = std::min<std::chrono::milliseconds>(retry * (1 << std::min(fails - 1, 6)), std::chrono::minutes(1));
+
+        fails++;
+
+        reconnect(wait);
+      }
+
+      // drops the connection without a close frame, which would end the
+      // session; ws_on_disconnect reconnects
+      void drop() {
+        ptyps::web::wss::Socket::disconnect();
+      }
+
+      // the last beat never got its ACK, so the connection's dead whatever
+      // tcp thinks; it's dropped rather than closed so the session resumes
+      void beat() {
+        if (sent) {
+          zombied++;
+          gateway_on_zombie();
+
+          return drop();
+        }
+
+        sent = std::chrono::steady_clock::now();
+
+        try {
+          if (!last)
+            send(opcode::HEARTBEAT, nullptr);
+
+          else
+            send(opcode::HEARTBEAT, last);
+        }
+
+        // it went away since, ws_on_disconnect has it
+        catch (const std::exception &err) {
+
+        }
+      }
 
       void ws_on_disconnect() {
+        cancel(heartbeat);
+        heartbeat = 0;
+        beats++;
+        sent.reset();
+        resuming = !1;
+
         gateway_on_disconnect();
+
+        reconnect();
+      }
+
+      void ws_on_fail(std::string_view why) {
+        gateway_on_fail(why);
+
+        reconnect();
       }
 
       void ws_on_connect() {
+        connections++;
+
+        // every connection is a new stream
+        if (inflater)
+          inflater->reset();
+
         gateway_on_connect();
       }
 
@@ -66,86 +637,820 @@ namespace ptyps::web::discord {
         gateway_on_open();
       }
 
-      void ws_on_close() {
+      void ws_on_close(ptyps::web::wss::status code) {
+        if (fatal(int(code)))
+          persistent = !1;
+
+        if (unresumable(int(code))) {
+          forget();
+          gateway_on_invalidated();
+        }
+
         gateway_on_close();
       }
 
-      void ws_on_text(std::string text) {
-        auto packet = ptyps::json::parse(text);
+      void send(opcode op, ptyps::json::obj data) {
+        if (!etf)
+          return write(createPacket(op, data));
+
+        write_binary(ptyps::etf::encode(ptyps::json::object({
+          {"op", std::underlying_type_t<opcode>(op)},
+          {"d", data}
+        })));
+      }
+
+      // only the envelope is looked at until something wants d, which
+      // is what keeps unhandled dispatches cheap; E is json::Envelope or
+      // etf::Envelope, whichever the url asked for
+      template <typename E>
+        void route(E &packet) {
+          if (!packet.valid())
+            return;
 
-        auto sequence = ptyps::json::value<int>(packet, "s");
+          if (packet.s)
+            last = *packet.s;
 
-        if (sequence)
-          last = *sequence;
+          auto opc = packet.op;
 
-        auto opc = ptyps::json::value<int>(packet, "op");
+          if (opc == OP_HELLO) {
+            if (session.size())
+              resume();
 
-        if (opc == OP_HELLO) {
-          auto payload = createPacket(opcode::IDENTIFY, {
-            {"token", *ptyps::json::value<std::string>(opts, "token")},
-            {"intents", 513},
-            {"properties", {
-              {"$browser", "chrome"},
-              {"$device", "chrome"},
-              {"$os", "linux"}
-            }}
-          });
+            else if (gateway_on_identify())
+              identify();
+
+            // heartbeat_interval apart, the first after a random part of one
+            // so shards that connect together don't all beat together
+            //
+            // https://discord.com/developers/docs/topics/gateway#sending-heartbeats
+
+            auto beat = ptyps::json::value<int>(packet.parse(), "heartbeat_interval");
+
+            auto time = std::chrono::milliseconds(beat.value_or(41250));
+            auto jitter = std::chrono::duration_cast<std::chrono::milliseconds>(time * (ptyps::random::word() / 4294967296.0));
+
+            // on the socket's io thread, along with everything else it does
+            cancel(heartbeat);
+            sent.reset();
 
-          write(payload);
+            auto epoch = ++beats;
 
-          // -----
+            heartbeat = after(jitter, [this, time, epoch]() {
+              if (epoch != beats)
+                return;
 
-          // This part confuses me. According to Discord, we have to send
-          // a heartbeat payload based on the heartbeat_interval provided
-          // to us. However, whenever I try this, it just... disconnects
-          // after sending it. This means, according to what I've got from
-          // reading the WebSocket RFIC, that it's been formatted incorrectly.
-          // However, I can't seem to find an example or an explanation
-          // of how to send this properly. So, it won't stay connected
-          // for long.
-          //
-          // https://discord.com/developers/docs/topics/gateway#heartbeat
+              this->beat();
 
-          auto beat = ptyps::json::value<int>(packet, "d.heartbeat_interval");
+              if (epoch != beats)
+                return;
 
-          auto time = std::chrono::milliseconds(*beat);
+              heartbeat = every(time, [this, epoch]() -> bool {
+                if (epoch != beats)
+                  return !0;
 
-          return ptyps::thread::interval_run(time, [&]() -> bool {
-            if (!connected())
-              return !0;
+                this->beat();
 
-            auto payload = std::string();
+                return epoch != beats;
+              });
+            });
 
+            return;
+          }
+
+          if (opc == OP_HEARTBEAT_ACK) {
+            if (sent)
+              lag.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - *sent).count());
+
+            sent.reset();
+            return;
+          }
+
+          // the gateway can ask for one out of turn, which isn't tracked
+          if (opc == OP_HEARTBEAT) {
             if (!last)
-              payload = createPacket(opcode::HEARTBEAT, nullptr);
+              send(opcode::HEARTBEAT, nullptr);
 
             else
-              payload = createPacket(opcode::HEARTBEAT, last);
+              send(opcode::HEARTBEAT, last);
 
-            write(payload);
+            return;
+          }
 
-            return !1;
-          });
-        }
+          // the gateway wants us somewhere else, the session comes along
+          if (opc == OP_RECONNECT) {
+            fails = 0;
+            return drop();
+          }
+
+          // d says whether it can still be resumed; either way it's on a new
+          // connection, after the 1 to 5 seconds discord asks for
+          if (opc == OP_INVALID_SESSION) {
+            auto data = packet.parse();
+
+            if (!data.is_bool() || !data.get_bool()) {
+              forget();
+              gateway_on_invalidated();
+            }
+
+            auto wait = retry + std::chrono::milliseconds(ptyps::random::word() % (4 * retry.count() + 1));
+
+            fails = 0;
+            reconnect(wait);
+
+            return drop();
+          }
       
-        if (opc == OP_DISPATCH) {
-          auto event = ptyps::json::value<std::string>(packet, "t");
+          if (opc == OP_DISPATCH) {
+            auto name = packet.t;
+
+            if (name.empty())
+              return;
+
+            auto kind = lookup(name);
+
+            if (kind == event::RESUMED) {
+              resuming = !1;
+              resumed++;
+              fails = 0;
+
+              gateway_on_resumed();
+            }
+
+            else if (resuming)
+              replayed++;
+
+            auto ready = kind == event::READY || kind == event::GUILD_CREATE;
+
+            // no one's going to look at d, so it isn't even found
+            if (!wanted[size_t(kind)] && !ready && !raw) {
+              skipped++;
+              return;
+            }
+
+            auto text = packet.data();
+
+            if (text.empty())
+              return;
+
+            if (raw)
+              gateway_on_dispatch(name, text);
+
+            if (!wanted[size_t(kind)] && !ready) {
+              skipped++;
+              return;
+            }
+
+            // nothing's built from d until a handler asks for json
+            auto data = Payload(packet);
+
+            if (kind == event::READY) {
+              auto url = data.value<std::string>("resume_gateway_url");
+
+              session = data.value<std::string>("session_id").value_or("");
+              resumable = url ? *url + "/" + query : "";
+              fails = 0;
+
+              gateway_on_ready(data);
+            }
+
+            if (kind == event::GUILD_CREATE)
+              gateway_on_guild_create(data);
+
+            for (auto &func : handlers[size_t(kind)])
+              func(data);
+          }
+        }
 
-          if (event == "READY") {
-            auto data = ptyps::json::get(packet, "d");
-            return gateway_on_ready(*data);
+      void ws_on_text(std::string_view text) {
+        auto packet = ptyps::json::Envelope(text);
+        route(packet);
+      }
+
+      void ws_on_binary(std::span<const std::byte> data) {
+        auto packet = ptyps::etf::Envelope(std::string_view((const char *) data.data(), data.size()));
+        route(packet);
+      }
+
+      // only with compress=zlib-stream; pieces are inflated as they arrive
+      // and a message is routed straight out of the inflater's buffer
+      void ws_on_fragment(ptyps::web::wss::opcode op, std::string_view piece, bool fin) {
+        auto i = inflater->feed(piece);
+
+        if (i == ptyps::zlib::progress::FAIL && inflater->oversized())
+          return close(ptyps::web::wss::status::MSG_TOO_BIG);
+
+        if (i == ptyps::zlib::progress::FAIL)
+          return close(ptyps::web::wss::status::INVALID_PAYLOAD);
+
+        if (i == ptyps::zlib::progress::INCOMPLETE)
+          return;
+
+        if (etf) {
+          auto packet = ptyps::etf::Envelope(inflater->data());
+          return route(packet);
+        }
+
+        auto packet = ptyps::json::Envelope(inflater->data());
+        route(packet);
+      }
+
+    public:
+      // opts needs a token; url is the gateway's, or a stand-in's such as
+      // simulator::Server, and its encoding query picks json or etf (and
+      // compress=zlib-stream compression). left empty it's discord's, with
+      // opts' "encoding" and "compress" if there are any
+      Gateway(ptyps::json::obj opts, std::string_view url) : ptyps::web::wss::Socket(url.size() ? std::string(url) : locate(opts)) {
+        this->opts = opts;
+        auto href = url.size() ? std::string(url) : locate(opts);
+        auto queries = ptyps::web::url::parse(href).queries;
+
+        this->origin = href;
+        this->query = href.substr(std::min(href.find('?'), href.size()));
+
+        this->etf = queries["encoding"] == "etf";
+
+        if (queries["compress"] == "zlib-stream") {
+          inflater = std::make_unique<ptyps::zlib::Inflater>();
+          inflater->max = INFLATE_LIMIT;
+          streaming(!0);
+        }
+      }
+
+      Gateway(std::string_view filepath) : Gateway(ptyps::json::open(&filepath[0]), "") {
+
+      }
+
+      ~Gateway() {
+        disconnect();
+      }
+
+      // first wait before reconnecting after a connection fails, doubled
+      // each time it fails again (up to a minute); an invalid session
+      // waits between this and five times it
+      std::chrono::milliseconds retry = std::chrono::seconds(1);
+
+      // largest message accepted before closing with MSG_TOO_BIG, 0 for no
+      // limit; with zlib-stream it's what a message inflates to that counts
+      void limit(size_t bytes) {
+        ptyps::web::wss::Socket::limit(bytes);
+
+        if (inflater)
+          inflater->max = bytes;
+      }
+
+      // starts connecting, and keeps at it until disconnect()
+      std::future<void> connect() {
+        persistent = !0;
+        fails = 0;
+
+        return ptyps::web::wss::Socket::connect();
+      }
+
+      // for good; the session's kept, so connect() again resumes it
+      void disconnect() {
+        persistent = !1;
+
+        cancel(reconnector);
+        reconnector = 0;
+
+        ptyps::web::wss::Socket::disconnect();
+      }
+
+      // func gets the d of every kind dispatch, after the gateway_on_*
+      // handlers; UNKNOWN gets the ones this doesn't know the name of.
+      // d is shared by every handler and only lasts the call, so copy what
+      // has to be kept; with etf, value<T>() reads it without building
+      // json, which only happens once something asks for json(). register
+      // before connecting, handlers run on the io thread
+      void on(event kind, std::function<void(const Payload &)> func) {
+        handlers[size_t(kind)].push_back(std::move(func));
+        wanted[size_t(kind)] = !0;
+      }
+
+      // whether gateway_on_dispatch sees every dispatch, set before connecting
+      void dispatches(bool enabled) {
+        raw = enabled;
+      }
+
+      // whether on() has anything for kind, the rest can be skipped
+      bool handled(event kind) {
+        return wanted[size_t(kind)];
+      }
+
+      bool handled(std::string_view name) {
+        return handled(lookup(name));
+      }
+
+      // dispatches nothing was registered for, whose d went unparsed
+      // unless gateway_on_dispatch wanted it
+      uint64_t unhandled() {
+        return skipped;
+      }
+
+      // inflate counters, only there with compress=zlib-stream
+      const ptyps::zlib::stats &compression() {
+        if (!inflater)
+          throw exception("gateway isn't compressed");
+
+        return inflater->counters;
+      }
+
+      bool compressed() {
+        return inflater != nullptr;
+      }
+
+      // RESUMEs that worked, and dispatches that came again with them
+      uint64_t resumes() {
+        return resumed;
+      }
+
+      uint64_t replays() {
+        return replayed;
+      }
+
+      // whether what's coming in now is being replayed after a RESUME
+      bool replaying() {
+        return resuming;
+      }
+
+      // heartbeat to ACK round trips in microseconds, and how many times
+      // one didn't come and the connection was dropped for it
+      const ptyps::metrics::Histogram &latency() {
+        return lag;
+      }
+
+      uint64_t zombies() {
+        return zombied;
+      }
+
+      // which connection this is, it goes up by one every time
+      uint64_t connection() {
+        return connections;
+      }
+
+      // whether READY has given this a session, which HELLO resumes rather
+      // than identifying again; only on the io thread
+      bool identified() {
+        return session.size();
+      }
+
+      // makes this shard id of count, set before connecting
+      void sharding(int id, int count) {
+        shard = {id, count};
+      }
+
+      // sends IDENTIFY, which is done as soon as HELLO turns up unless
+      // gateway_on_identify held it back; safe from any thread
+      void identify() {
+        if (!connected())
+          return;
+
+        auto data = ptyps::json::object({
+          {"token", *ptyps::json::value<std::string>(opts, "token")},
+          {"intents", 513},
+          {"properties", {
+            {"$browser", "chrome"},
+            {"$device", "chrome"},
+            {"$os", "linux"}
+          }}
+        });
+
+        if (shard)
+          ptyps::json::put(data, "shard", ptyps::json::object({shard->first, shard->second}));
+
+        try {
+          send(opcode::IDENTIFY, data);
+        }
+
+        // it went away since connected() said otherwise
+        catch (const std::exception &err) {
+
+        }
+      }
+
+      // sends RESUME for the session READY gave us, done on HELLO instead
+      // of IDENTIFY whenever there is one
+      void resume() {
+        if (!connected() || session.empty())
+          return;
+
+        auto data = ptyps::json::object({
+          {"token", *ptyps::json::value<std::string>(opts, "token")},
+          {"session_id", session},
+          {"seq", last}
+        });
+
+        resuming = !0;
+
+        try {
+          send(opcode::RESUME, data);
+        }
+
+        catch (const std::exception &err) {
+
+        }
+      }
+  };
+
+  // -----
+
+  struct recommendation {
+    public:
+      std::string url = GATEWAY;
+      int shards = 1;
+      int concurrency = 1;
+  };
+
+  // asks GET /gateway/bot where to connect, how many shards to run and how
+  // many of them can identify at once
+  recommendation recommend(std::string token, std::string api = API) {
+    auto curl = curl_easy_init();
+
+    if (!curl)
+      throw exception("recommend not able to init curl");
+
+    auto body = std::string();
+    auto href = api + "/gateway/bot";
+    auto auth = "Authorization: Bot " + token;
+    auto headers = curl_slist_append(nullptr, auth.c_str());
+
+    auto collect = +[](char* data, size_t size, size_t count, std::string* out) -> size_t {
+      out->append(data, size * count);
+      return size * count;
+    };
+
+    curl_easy_setopt(curl, CURLOPT_URL, href.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+
+    // trusts whatever the gateway connections do
+    auto &settings = ptyps::web::ssl::settings;
+
+    if (settings.ca_file.size())
+      curl_easy_setopt(curl, CURLOPT_CAINFO, settings.ca_file.c_str());
+
+    if (settings.ca_path.size())
+      curl_easy_setopt(curl, CURLOPT_CAPATH, settings.ca_path.c_str());
+
+    auto code = long();
+    auto i = curl_easy_perform(curl);
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+
+    if (i != CURLE_OK || code != 200)
+      throw exception("unable to get gateway recommendation");
+
+    auto found = ptyps::json::parse(body);
+    auto out = recommendation();
+
+    out.url = ptyps::json::value<std::string>(found, "url").value_or(GATEWAY);
+    out.shards = ptyps::json::value<int>(found, "shards").value_or(1);
+    out.concurrency = ptyps::json::value<int>(found, "session_start_limit.max_concurrency").value_or(1);
+
+    return out;
+  }
+
+  // Runs every shard of one bot on a few io threads of its own. IDENTIFYs
+  // go out in max_concurrency buckets (shard id % concurrency), one per
+  // bucket every spacing, and whatever the shards hear comes to the one set
+  // of shards_on_* handlers along with the shard's id. Those run on the io
+  // threads, so shards on different threads can be in them at once.
+
+  class ShardManager {
+    private:
+      using clock = std::chrono::steady_clock;
+
+      class Shard : public Gateway {
+        private:
+          ShardManager &owner;
+          int id;
+
+          bool gateway_on_identify() {
+            return owner.admit(id, connection());
           }
 
-          if (event == "GUILD_CREATE") {
-            auto data = ptyps::json::get(packet, "d");
-            return gateway_on_guild_create(*data);
+          void gateway_on_disconnect() {
+            owner.shards_on_disconnect(id);
           }
+
+          void gateway_on_connect() {
+            owner.shards_on_connect(id);
+          }
+
+          void gateway_on_fail(std::string_view why) {
+            owner.shards_on_fail(id, why);
+          }
+
+          void gateway_on_open() {
+            owner.shards_on_open(id);
+          }
+
+          void gateway_on_close() {
+            owner.shards_on_close(id);
+          }
+
+          void gateway_on_dispatch(std::string_view event, std::string_view data) {
+            owner.shards_on_dispatch(id, event, data);
+          }
+
+          void gateway_on_ready(const Payload &data) {
+            owner.shards_on_ready(id, data);
+          }
+
+          void gateway_on_guild_create(const Payload &data) {
+            owner.shards_on_guild_create(id, data);
+          }
+
+          void gateway_on_resumed() {
+            owner.shards_on_resumed(id);
+          }
+
+          void gateway_on_invalidated() {
+            owner.shards_on_invalidated(id);
+          }
+
+          void gateway_on_zombie() {
+            owner.shards_on_zombie(id);
+          }
+
+        public:
+          Shard(ShardManager &owner, int id, std::string_view url) : Gateway(owner.opts, url), owner(owner), id(id) {
+            sharding(id, owner.plan.shards);
+            attach(owner.io);
+
+            retry = owner.retry;
+          }
+
+          ~Shard() {
+            disconnect();
+          }
+      };
+
+      struct bucket {
+        public:
+          clock::time_point next;
+          std::deque<int> waiting;
+          bool scheduled = !1;
+      };
+
+      // by shard, the connection it's waiting to identify on, 0 if it
+      // isn't in a bucket's line
+      std::vector<uint64_t> queued;
+
+      ptyps::json::obj opts;
+      recommendation plan;
+
+      std::mutex lock;
+      std::vector<bucket> buckets;
+      bool stopping = !1;
+
+      // what on() registered, by event
+      std::array<std::vector<std::function<void(int, const Payload &)>>, std::size(events)> handlers;
+      bool raw = !1;
+
+      // declared before the shards so it's still running while they go
+      ptyps::web::reactor::Reactor io;
+      std::vector<std::unique_ptr<Shard>> shards;
+
+      // whether shard id can identify on connection right now, if not it's
+      // queued; one that reconnected while waiting keeps its place in line
+      bool admit(int id, uint64_t connection) {
+        auto guard = std::lock_guard(lock);
+        auto index = id % buckets.size();
+        auto &next = buckets[index];
+        auto now = clock::now();
+
+        if (queued[id]) {
+          queued[id] = connection;
+          return !1;
         }
+
+        if (next.waiting.empty() && next.next <= now) {
+          next.next = now + spacing;
+          return !0;
+        }
+
+        queued[id] = connection;
+
+        next.waiting.push_back(id);
+        schedule(index);
+
+        return !1;
+      }
+
+      // lock has to be held
+      void schedule(size_t index) {
+        auto &next = buckets[index];
+
+        if (next.scheduled || next.waiting.empty())
+          return;
+
+        next.scheduled = !0;
+
+        auto wait = std::max(next.next - clock::now(), clock::duration::zero());
+
+        io.pick().after(wait, [this, index]() {
+          release(index);
+        });
       }
 
+      // lets the next shard waiting on a bucket identify, skipping any whose
+      // connection has gone since it was queued
+      void release(size_t index) {
+        auto guard = std::lock_guard(lock);
+        auto &next = buckets[index];
+
+        next.scheduled = !1;
+
+        while (!stopping && next.waiting.size()) {
+          auto id = next.waiting.front();
+          auto connection = queued[id];
+
+          next.waiting.pop_front();
+          queued[id] = 0;
+
+          if (connection != shards[id]->connection())
+            continue;
+
+          next.next = clock::now() + spacing;
+
+          // on the shard's own io thread, where its session is looked after
+          shards[id]->after(std::chrono::milliseconds(0), [this, id, connection]() {
+            auto guard = std::lock_guard(lock);
+
+            if (stopping || id >= int(shards.size()))
+              return;
+
+            auto &shard = *shards[id];
+
+            if (shard.connection() == connection && !shard.identified())
+              shard.identify();
+          });
+
+          break;
+        }
+
+        schedule(index);
+      }
+
+      virtual void shards_on_disconnect(int shard) { }
+      virtual void shards_on_connect(int shard) { }
+      virtual void shards_on_fail(int shard, std::string_view why) { }
+      virtual void shards_on_open(int shard) { }
+      virtual void shards_on_close(int shard) { }
+
+      // only called once dispatches(true), see Gateway's
+      virtual void shards_on_dispatch(int shard, std::string_view event, std::string_view data) { }
+      virtual void shards_on_ready(int shard, const Payload &data) { }
+      virtual void shards_on_guild_create(int shard, const Payload &data) { }
+      virtual void shards_on_resumed(int shard) { }
+      virtual void shards_on_invalidated(int shard) { }
+      virtual void shards_on_zombie(int shard) { }
+
     public:
-      Gateway(std::string_view filepath) : ptyps::web::wss::Socket("wss://gateway.discord.gg/?v=9&encoding=json") {
-        opts = ptyps::json::open(&filepath[0]);
+      // how long a bucket waits between IDENTIFYs
+      std::chrono::milliseconds spacing = std::chrono::seconds(5);
+
+      // see Gateway's, set before starting
+      std::chrono::milliseconds retry = std::chrono::seconds(1);
+
+      ShardManager(ptyps::json::obj opts, recommendation plan, size_t threads = ptyps::web::reactor::threads) : opts(opts), plan(plan), io(threads) {
+        if (plan.shards < 1 || plan.concurrency < 1)
+          throw exception("invalid shard recommendation");
+
+        buckets.resize(plan.concurrency);
+        queued.assign(plan.shards, 0);
+      }
+
+      // opts needs a token, and can pick an "encoding" of json or etf and
+      // whether to "compress"; "shards" (with "concurrency" and "gateway")
+      // saves asking /gateway/bot, "api" asks somewhere else
+      ShardManager(ptyps::json::obj opts, size_t threads = ptyps::web::reactor::threads) : ShardManager(opts, [&]() {
+        auto count = ptyps::json::value<int>(opts, "shards");
+
+        if (!count)
+          return recommend(*ptyps::json::value<std::string>(opts, "token"), ptyps::json::value<std::string>(opts, "api").value_or(API));
+
+        auto out = recommendation();
+
+        out.url = ptyps::json::value<std::string>(opts, "gateway").value_or(GATEWAY);
+        out.shards = *count;
+        out.concurrency = ptyps::json::value<int>(opts, "concurrency").value_or(1);
+
+        return out;
+      }(), threads) {
+
+      }
+
+      ShardManager(const ShardManager &) = delete;
+
+      virtual ~ShardManager() {
+        stop();
+      }
+
+      // connects every shard, their IDENTIFYs are spaced out as they go
+      void start() {
+        if (shards.size())
+          throw exception("shards are already started");
+
+        auto url = plan.url;
+
+        if (url.find('?') == std::string::npos)
+          url = locate(opts, url);
+
+        for (auto i = 0; i < plan.shards; i++) {
+          shards.push_back(std::make_unique<Shard>(*this, i, url));
+          shards.back()->dispatches(raw);
+
+          for (auto kind = size_t(0); kind < handlers.size(); kind++) {
+            if (handlers[kind].empty())
+              continue;
+
+            shards.back()->on(event(kind), [this, i, kind](const Payload &data) {
+              for (auto &func : handlers[kind])
+                func(i, data);
+            });
+          }
+        }
+
+        for (auto &next : shards)
+          next->connect();
+      }
+
+      // whether shards_on_dispatch sees every dispatch, set before starting
+      void dispatches(bool enabled) {
+        raw = enabled;
+      }
+
+      // like Gateway::on, with the shard's id; register before starting
+      void on(event kind, std::function<void(int, const Payload &)> func) {
+        handlers[size_t(kind)].push_back(std::move(func));
+      }
+
+      // RESUMEs across every shard, and the dispatches replayed by them
+      uint64_t resumes() {
+        auto out = uint64_t(0);
+
+        for (auto &next : shards)
+          out += next->resumes();
+
+        return out;
+      }
+
+      uint64_t replays() {
+        auto out = uint64_t(0);
+
+        for (auto &next : shards)
+          out += next->replays();
+
+        return out;
+      }
+
+      // connections dropped for an unanswered heartbeat; each shard has its
+      // own latency()
+      uint64_t zombies() {
+        auto out = uint64_t(0);
+
+        for (auto &next : shards)
+          out += next->zombies();
+
+        return out;
+      }
+
+      // disconnects and forgets every shard
+      void stop() {
+        {
+          auto guard = std::lock_guard(lock);
+          stopping = !0;
+
+          for (auto &next : buckets)
+            next.waiting.clear();
+
+          std::fill(queued.begin(), queued.end(), 0);
+        }
+
+        shards.clear();
+
+        auto guard = std::lock_guard(lock);
+        stopping = !1;
+      }
+
+      size_t size() {
+        return plan.shards;
+      }
+
+      int concurrency() {
+        return plan.concurrency;
+      }
+
+      // only there once started
+      Gateway &shard(int id) {
+        return *shards.at(id);
       }
   };
-}
\ No newline at end of file
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+#include "./net.hpp"
+
+namespace ptyps::web::dns {
+  using clock = std::chrono::steady_clock;
+  using answer = std::vector<ptyps::web::net::endpoint>;
+
+  // where answers come from when they're not cached or pinned
+  using source = std::function<answer(const std::string &host)>;
+
+  // the system's resolver, getaddrinfo() under the hood
+  answer system(const std::string &host) {
+    auto out = answer();
+    auto hints = addrinfo();
+    addrinfo* ai = nullptr;
+
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    if (::getaddrinfo(host.c_str(), nullptr, &hints, &ai) != 0)
+      return out;
+
+    for (auto next = ai; next; next = next->ai_next) {
+      auto ep = ptyps::web::net::to_endpoint(next->ai_addr);
+
+      if (ep)
+        out.push_back(*ep);
+    }
+
+    ::freeaddrinfo(ai);
+
+    return out;
+  }
+
+  // Resolves host names off the io threads and remembers the answers.
+  // getaddrinfo() doesn't say what a record's TTL was, so answers are kept
+  // for ttl (failures for negative) and then looked up again. Many sockets
+  // asking for the same name at once share a single lookup, and names can
+  // be pinned to fixed addresses, one at a time or from a hosts file.
+  // Lookups run on a few threads of the resolver's own, so a name that's
+  // slow to answer (or times out) doesn't hold up any other.
+
+  class Resolver {
+    private:
+      struct entry {
+        public:
+          answer found;
+          clock::time_point expires;
+      };
+
+      using callback = std::function<void(answer)>;
+
+      source from;
+
+      std::mutex lock;
+      std::condition_variable wake;
+      std::unordered_map<std::string, entry> cache;
+      std::unordered_map<std::string, answer> pinned;
+
+      // names being looked up, and who's waiting on each
+      std::unordered_map<std::string, std::vector<callback>> waiting;
+      std::deque<std::string> jobs;
+
+      std::atomic<size_t> count = 0;
+      bool running = !0;
+      std::vector<std::thread> workers;
+
+      void run() {
+        while (!0) {
+          auto lock = std::unique_lock(this->lock);
+
+          wake.wait(lock, [&]() {
+            return !running || jobs.size();
+          });
+
+          if (!running)
+            return;
+
+          auto host = std::move(jobs.front());
+          jobs.pop_front();
+
+          lock.unlock();
+
+          auto found = from(host);
+          count++;
+
+          lock.lock();
+
+          cache[host] = entry({found, clock::now() + (found.size() ? ttl.load() : negative.load())});
+
+          auto funcs = std::move(waiting[host]);
+          waiting.erase(host);
+
+          lock.unlock();
+
+          for (auto &func : funcs)
+            func(found);
+        }
+      }
+
+    public:
+      std::atomic<clock::duration> ttl = clock::duration(std::chrono::seconds(60));
+      std::atomic<clock::duration> negative = clock::duration(std::chrono::seconds(5));
+
+      // threads is how many names can be looked up at once
+      Resolver(source from = system, size_t threads = 4) : from(from) {
+        for (auto i = size_t(0); i < std::max<size_t>(threads, 1); i++)
+          workers.emplace_back([this]() {
+            run();
+          });
+      }
+
+      Resolver(const Resolver &) = delete;
+
+      ~Resolver() {
+        {
+          auto guard = std::lock_guard(lock);
+          running = !1;
+        }
+
+        wake.notify_all();
+
+        for (auto &next : workers)
+          next.join();
+      }
+
+      // func gets the answer, right away on this thread if it's cached (or
+      // host is an address already), otherwise on one of the resolver's
+      void resolve(const std::string &host, callback func) {
+        auto literal = ptyps::web::net::to_endpoint(host);
+
+        if (literal)
+          return func({*literal});
+
+        auto lock = std::unique_lock(this->lock);
+
+        auto pin = pinned.find(host);
+
+        if (pin != pinned.end()) {
+          auto found = pin->second;
+          lock.unlock();
+          return func(found);
+        }
+
+        auto hit = cache.find(host);
+
+        if (hit != cache.end() && hit->second.expires > clock::now()) {
+          auto found = hit->second.found;
+          lock.unlock();
+          return func(found);
+        }
+
+        auto &list = waiting[host];
+        list.push_back(std::move(func));
+
+        // someone's already looking it up
+        if (list.size() > 1)
+          return;
+
+        jobs.push_back(host);
+        lock.unlock();
+
+        wake.notify_one();
+      }
+
+      std::future<answer> resolve(const std::string &host) {
+        auto done = std::make_shared<std::promise<answer>>();
+        auto out = done->get_future();
+
+        resolve(host, [done](answer found) {
+          done->set_value(std::move(found));
+        });
+
+        return out;
+      }
+
+      // always answer host with list, whatever the source says
+      void pin(const std::string &host, answer list) {
+        auto guard = std::lock_guard(lock);
+        pinned[host] = std::move(list);
+      }
+
+      void unpin(const std::string &host) {
+        auto guard = std::lock_guard(lock);
+        pinned.erase(host);
+      }
+
+      // pins everything in a hosts(5) style file, returns how many names
+      size_t hosts(const std::string &path) {
+        auto file = std::ifstream(path);
+
+        if (!file)
+          throw ptyps::err::exception("unable to open hosts file");
+
+        auto found = std::unordered_map<std::string, answer>();
+        auto line = std::string();
+
+        while (std::getline(file, line)) {
+          line = line.substr(0, line.find('#'));
+
+          auto words = std::istringstream(line);
+          auto addr = std::string();
+
+          if (!(words >> addr))
+            continue;
+
+          auto ep = ptyps::web::net::to_endpoint(addr);
+
+          if (!ep)
+            continue;
+
+          auto name = std::string();
+
+          while (words >> name)
+            found[name].push_back(*ep);
+        }
+
+        auto guard = std::lock_guard(lock);
+
+        for (auto &[name, list] : found)
+          pinned[name] = list;
+
+        return found.size();
+      }
+
+      // drops cached answers, all of them or just host's
+      void forget(const std::string &host = "") {
+        auto guard = std::lock_guard(lock);
+
+        if (host.empty())
+          return cache.clear();
+
+        cache.erase(host);
+      }
+
+      // how many lookups actually went to the source
+      size_t lookups() {
+        return count;
+      }
+  };
+
+  Resolver &shared() {
+    static auto out = Resolver();
+    return out;
+  }
+}
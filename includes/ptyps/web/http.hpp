@@ -0,0 +1,181 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <string_view>
+#include <optional>
+#include <cstring>
+#include <cctype>
+#include <utility>
+#include <array>
+
+namespace ptyps::web::http {
+  enum class progress {
+    INCOMPLETE,
+    COMPLETE,
+    FAIL
+  };
+
+  // case insensitive comparison, for header names and tokens
+  inline bool same(std::string_view a, std::string_view b) {
+    if (a.size() != b.size())
+      return !1;
+
+    for (auto i = size_t(0); i < a.size(); i++) {
+      if (std::tolower(a[i]) != std::tolower(b[i]))
+        return !1;
+    }
+
+    return !0;
+  }
+
+  inline std::string_view trim(std::string_view text) {
+    while (text.size() && (text.front() == ' ' || text.front() == '\t'))
+      text.remove_prefix(1);
+
+    while (text.size() && (text.back() == ' ' || text.back() == '\t'))
+      text.remove_suffix(1);
+
+    return text;
+  }
+
+  // Incremental HTTP/1.1 response head parser. Bytes are copied into a fixed
+  // buffer until the blank line ending the head turns up, so nothing is
+  // allocated, and the status line and headers are then views into that
+  // buffer. feed() says how many of the bytes it was given belonged to the
+  // head; whatever follows is body (or, after an upgrade, the first frames).
+
+  class Response {
+    private:
+      std::array<char, 8192> buffer;
+      size_t used = 0;
+
+      std::array<std::pair<std::string_view, std::string_view>, 64> fields;
+      size_t count = 0;
+
+      int code = 0;
+      std::string_view reason;
+
+      progress state = progress::INCOMPLETE;
+
+      bool parse(std::string_view head) {
+        auto eol = head.find("\r\n");
+        auto top = head.substr(0, eol);
+
+        if (!top.starts_with("HTTP/1.1 ") || top.size() < 12)
+          return !1;
+
+        code = 0;
+
+        for (auto next : top.substr(9, 3)) {
+          if (next < '0' || next > '9')
+            return !1;
+
+          code = code * 10 + (next - '0');
+        }
+
+        reason = trim(top.substr(12));
+
+        head.remove_prefix(eol + 2);
+
+        while (head.size()) {
+          eol = head.find("\r\n");
+
+          auto line = head.substr(0, eol);
+          auto colon = line.find(':');
+
+          if (colon == std::string_view::npos || count == fields.size())
+            return !1;
+
+          fields[count++] = {trim(line.substr(0, colon)), trim(line.substr(colon + 1))};
+
+          head.remove_prefix(eol == std::string_view::npos ? head.size() : eol + 2);
+        }
+
+        return !0;
+      }
+
+    public:
+      // returns where the response stands and how many bytes of data it used
+      std::pair<progress, size_t> feed(std::string_view data) {
+        if (state != progress::INCOMPLETE)
+          return {state, 0};
+
+        auto take = std::min(data.size(), buffer.size() - used);
+        auto from = used < 3 ? 0 : used - 3;
+
+        std::memcpy(buffer.data() + used, data.data(), take);
+        used += take;
+
+        auto seen = std::string_view(buffer.data(), used);
+        auto end = seen.find("\r\n\r\n", from);
+
+        if (end == std::string_view::npos) {
+          if (used == buffer.size())
+            state = progress::FAIL;
+
+          return {state, take};
+        }
+
+        auto before = used - take;
+
+        used = end + 4;
+        state = parse(seen.substr(0, end)) ? progress::COMPLETE : progress::FAIL;
+
+        return {state, used - before};
+      }
+
+      void reset() {
+        used = 0;
+        count = 0;
+        code = 0;
+        state = progress::INCOMPLETE;
+      }
+
+      int status() const {
+        return code;
+      }
+
+      std::string_view message() const {
+        return reason;
+      }
+
+      std::optional<std::string_view> header(std::string_view name) const {
+        for (auto i = size_t(0); i < count; i++) {
+          if (same(fields[i].first, name))
+            return fields[i].second;
+        }
+
+        return {};
+      }
+
+      // whether a comma separated header (Connection, Upgrade) lists token
+      bool lists(std::string_view name, std::string_view token) const {
+        for (auto i = size_t(0); i < count; i++) {
+          if (!same(fields[i].first, name))
+            continue;
+
+          auto value = fields[i].second;
+
+          while (value.size()) {
+            auto comma = value.find(',');
+
+            if (same(trim(value.substr(0, comma)), token))
+              return !0;
+
+            value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+          }
+        }
+
+        return !1;
+      }
+
+      size_t size() const {
+        return count;
+      }
+
+      std::pair<std::string_view, std::string_view> at(size_t i) const {
+        return fields[i];
+      }
+  };
+}
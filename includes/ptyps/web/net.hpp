@@ -5,10 +5,18 @@
 #include "../error.hpp"
 #include "../funcs.hpp"
 
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <exception>
+#include <optional>
+#include <cstring>
+#include <chrono>
+#include <poll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <variant>
+#include <span>
 #include <netdb.h>
 #include <string>
 #include <vector>
@@ -19,7 +27,8 @@ namespace ptyps::web::net {
 
   enum class status {
     FAIL = EOF,
-    OK
+    OK,
+    WAITING // the socket has to become writable before the rest can go
   };
 
   enum class family {
@@ -301,9 +310,13 @@ namespace ptyps::web::net {
   // return a list of IPv4 and/or IPv6 addresses
   std::vector<std::string> lookup(std::string_view host, family f = family::Unspecified) {
     std::vector<std::string> out;
-    addrinfo* ai;
+    addrinfo* ai = nullptr;
 
-    getaddrinfo(&host[0], NULL, NULL, &ai);
+    auto hints = addrinfo();
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (::getaddrinfo(std::string(host).c_str(), NULL, &hints, &ai) != 0)
+      return out;
 
     for (auto next = ai; next != NULL; next = next->ai_next) {
       auto fam = get_family(next);
@@ -361,55 +374,419 @@ namespace ptyps::web::net {
       status::FAIL : status::OK;
   }
 
+  // ----
+
+  // An address ready to hand to connect(), whichever family it is. Unlike
+  // an addrinfo it owns its storage, so it can be copied and cached.
+  struct endpoint {
+    public:
+      sockaddr_storage addr = {};
+      socklen_t size = 0;
+
+      int family() const {
+        return addr.ss_family;
+      }
+  };
+
+  std::optional<endpoint> to_endpoint(std::string_view ip, uint16_t port = 0) {
+    auto out = endpoint();
+    auto text = std::string(ip);
+
+    auto v6 = (sockaddr_in6 *) &out.addr;
+    auto v4 = (sockaddr_in *) &out.addr;
+
+    if (::inet_pton(AF_INET6, text.c_str(), &v6->sin6_addr) == 1) {
+      v6->sin6_family = AF_INET6;
+      v6->sin6_port = htons(port);
+      out.size = sizeof(sockaddr_in6);
+      return out;
+    }
+
+    if (::inet_pton(AF_INET, text.c_str(), &v4->sin_addr) == 1) {
+      v4->sin_family = AF_INET;
+      v4->sin_port = htons(port);
+      out.size = sizeof(sockaddr_in);
+      return out;
+    }
+
+    return {};
+  }
+
+  std::optional<endpoint> to_endpoint(const sockaddr* sa) {
+    auto out = endpoint();
+
+    if (sa->sa_family == AF_INET6)
+      out.size = sizeof(sockaddr_in6);
+
+    else if (sa->sa_family == AF_INET)
+      out.size = sizeof(sockaddr_in);
+
+    else
+      return {};
+
+    std::memcpy(&out.addr, sa, out.size);
+    return out;
+  }
+
+  std::string get_addr(const endpoint &ep) {
+    char out[INET6_ADDRSTRLEN] = {};
+
+    if (ep.family() == AF_INET6)
+      ::inet_ntop(AF_INET6, &((sockaddr_in6 *) &ep.addr)->sin6_addr, out, sizeof(out));
+
+    if (ep.family() == AF_INET)
+      ::inet_ntop(AF_INET, &((sockaddr_in *) &ep.addr)->sin_addr, out, sizeof(out));
+
+    return out;
+  }
+
+  void set_port(endpoint &ep, uint16_t p) {
+    if (ep.family() == AF_INET6)
+      ((sockaddr_in6 *) &ep.addr)->sin6_port = htons(p);
+
+    if (ep.family() == AF_INET)
+      ((sockaddr_in *) &ep.addr)->sin_port = htons(p);
+  }
+
+  // a non-blocking tcp socket for ep's family
+  std::optional<uint> open(const endpoint &ep) {
+    auto i = ::socket(ep.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+
+    if (i == EOF)
+      return {};
+
+    auto one = 1;
+    ::setsockopt(i, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return i;
+  }
+
+  // starts connecting a non-blocking socket, WAITING means it's underway
+  // and the socket turns writable once it's settled one way or the other
+  status connect(uint id, const endpoint &ep) {
+    if (::connect(id, (const sockaddr *) &ep.addr, ep.size) == 0)
+      return status::OK;
+
+    return errno == EINPROGRESS ?
+      status::WAITING : status::FAIL;
+  }
+
+  // whether a connect that was underway worked out
+  status connected(uint id) {
+    auto err = 0;
+    auto len = socklen_t(sizeof(err));
+
+    if (::getsockopt(id, SOL_SOCKET, SO_ERROR, &err, &len) == EOF || err)
+      return status::FAIL;
+
+    return status::OK;
+  }
+
+  // ----
+
+  // Races connects to a host's addresses (RFC 8305, Happy Eyeballs). The
+  // addresses are interleaved by family, starting with IPv6, and a new
+  // attempt starts every stagger (or as soon as the last one fails) until
+  // one of them connects. It's driven in steps so it can run on an event
+  // loop; run() drives it with poll() for callers that can block.
+
+  class Eyeballs {
+    private:
+      using clock = std::chrono::steady_clock;
+
+      std::vector<endpoint> order;
+      size_t index = 0;
+
+      // sockets still connecting and which address each is for
+      std::vector<std::pair<uint, size_t>> attempts;
+      clock::time_point started;
+
+      std::optional<size_t> won;
+
+      void drop(size_t i) {
+        ::close(attempts[i].first);
+        attempts.erase(attempts.begin() + i);
+      }
+
+    public:
+      std::chrono::milliseconds stagger = std::chrono::milliseconds(250);
+
+      Eyeballs(const std::vector<endpoint> &list, uint16_t port) {
+        auto v6 = std::vector<endpoint>();
+        auto v4 = std::vector<endpoint>();
+
+        for (auto next : list) {
+          set_port(next, port);
+          (next.family() == AF_INET6 ? v6 : v4).push_back(next);
+        }
+
+        for (auto i = size_t(0); i < std::max(v6.size(), v4.size()); i++) {
+          if (i < v6.size())
+            order.push_back(v6[i]);
+
+          if (i < v4.size())
+            order.push_back(v4[i]);
+        }
+      }
+
+      Eyeballs(const Eyeballs &) = delete;
+
+      ~Eyeballs() {
+        abandon();
+      }
+
+      // starts the next attempt; connects that fail on the spot are
+      // skipped, so this only comes back empty once nothing is left
+      std::optional<uint> start() {
+        while (index < order.size()) {
+          auto &next = order[index++];
+          auto id = open(next);
+
+          if (!id)
+            continue;
+
+          auto i = connect(*id, next);
+
+          if (i == status::FAIL) {
+            ::close(*id);
+            continue;
+          }
+
+          attempts.push_back({*id, index - 1});
+          started = clock::now();
+
+          if (i == status::OK)
+            settle(*id);
+
+          return id;
+        }
+
+        return {};
+      }
+
+      // whether another attempt is due, now that stagger has gone by
+      bool due() {
+        if (won || index == order.size())
+          return !1;
+
+        return attempts.empty() || clock::now() - started >= stagger;
+      }
+
+      // how long until another attempt is due
+      clock::duration until() {
+        if (attempts.empty())
+          return clock::duration::zero();
+
+        return std::max(clock::duration::zero(), started + stagger - clock::now());
+      }
+
+      // call once id turns writable, returns OK if it won the race
+      status settle(uint id) {
+        for (auto i = size_t(0); i < attempts.size(); i++) {
+          if (attempts[i].first != id)
+            continue;
+
+          if (connected(id) == status::FAIL) {
+            drop(i);
+            return status::FAIL;
+          }
+
+          won = attempts[i].second;
+          attempts.erase(attempts.begin() + i);
+
+          abandon();
+          return status::OK;
+        }
+
+        return status::FAIL;
+      }
+
+      // gives up on every attempt still connecting
+      void abandon() {
+        while (attempts.size())
+          drop(attempts.size() - 1);
+      }
+
+      // addresses not tried yet
+      size_t left() {
+        return won ? 0 : order.size() - index;
+      }
+
+      // whether there's nothing left that could still connect
+      bool exhausted() {
+        return !won && attempts.empty() && index == order.size();
+      }
+
+      std::vector<uint> pending() {
+        auto out = std::vector<uint>();
+
+        for (auto [id, _] : attempts)
+          out.push_back(id);
+
+        return out;
+      }
+
+      // the address that won
+      std::optional<endpoint> winner() {
+        if (!won)
+          return {};
+
+        return order[*won];
+      }
+
+      // blocks until an attempt connects (returning its socket) or every
+      // address has failed or timeout has gone by
+      std::optional<uint> run(clock::duration timeout) {
+        auto deadline = clock::now() + timeout;
+
+        while (!exhausted() && clock::now() < deadline) {
+          if (due()) {
+            auto id = start();
+
+            if (won)
+              return id;
+
+            continue;
+          }
+
+          auto fds = std::vector<pollfd>();
+
+          for (auto id : pending())
+            fds.push_back(pollfd({int(id), POLLOUT, 0}));
+
+          auto wait = std::min(deadline - clock::now(), index < order.size() ? until() : deadline - clock::now());
+          auto ms = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+
+          if (::poll(fds.data(), fds.size(), std::max<int>(ms, 0)) <= 0)
+            continue;
+
+          for (auto &next : fds) {
+            if (!next.revents || settle(next.fd) != status::OK)
+              continue;
+
+            return next.fd;
+          }
+        }
+
+        abandon();
+        return {};
+      }
+  };
+
+  // ----
+
   enum class event {
     ERROR = EOF,
     WAITING,
     DISCONNECTED
   };
 
-  std::variant<event, std::string> recv(uint id, size_t size = 1024) {
-    std::vector<char> buffer(size);
-    std::string recvd;
-    int len = 0;
-
-    while (!0) {
-      auto i = (int) ::read(id, &buffer[0], size);
+  // like ssl::recv, reads what's ready into into and returns a view of it
+  std::variant<event, std::string_view> recv(uint id, std::span<char> into) {
+    auto used = size_t(0);
 
-      if (i == EOF) {
-        if (errno == EAGAIN)
-          return event::WAITING;
+    while (used < into.size()) {
+      auto i = ::read(id, into.data() + used, into.size() - used);
 
-        return event::ERROR;
+      if (i > 0) {
+        used += i;
+        continue;
       }
 
+      if (used)
+        break;
+
       if (i == 0)
         return event::DISCONNECTED;
 
-      auto begin = ptyps::iter::begin(buffer, 0);
-      auto end = ptyps::iter::begin(buffer, i);
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return event::WAITING;
 
-      recvd += std::string(begin, end);
-      buffer.clear();
-      len += i;
+      return event::ERROR;
+    }
+
+    return std::string_view(into.data(), used);
+  }
+
+  // sent is bumped by however much made it out, including on WAITING
+  status send(uint id, std::string_view text, size_t &sent) {
+    auto pos = size_t(0);
+
+    while (pos < text.size()) {
+      auto len = ::send(id, text.data() + pos, text.size() - pos, MSG_NOSIGNAL);
+
+      if (len == EOF) {
+        if (errno == EINTR)
+          continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return status::WAITING;
+
+        return status::FAIL;
+      }
 
-      if (i < size)
-        return recvd;
+      pos += len;
+      sent += len;
     }
+
+    return status::OK;
   }
 
-  template <typename ...A>
-    status send(uint id, std::string text) {
-      while(text.size()) {
-        auto len = ::send(id, &text[0], text.size(), 0);
+  // gathers list into as few sendmsg() calls as it takes
+  status send(uint id, std::span<const std::string_view> list, size_t &sent) {
+    iovec vecs[64];
+
+    while (list.size()) {
+      auto count = std::min(list.size(), std::size(vecs));
+
+      for (auto i = size_t(0); i < count; i++)
+        vecs[i] = iovec({(void *) list[i].data(), list[i].size()});
+
+      auto msg = msghdr();
+
+      msg.msg_iov = vecs;
+      msg.msg_iovlen = count;
 
-        if (len == EOF)
-          return status::FAIL;
+      auto len = ::sendmsg(id, &msg, MSG_NOSIGNAL);
 
-        auto begin = std::begin(text);
+      if (len == EOF) {
+        if (errno == EINTR)
+          continue;
 
-        text.erase(begin, begin + len);
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return status::WAITING;
+
+        return status::FAIL;
       }
 
-      return status::OK;
+      sent += len;
+
+      // skip whatever went, which may end part way through a buffer
+      while (list.size() && size_t(len) >= list.front().size()) {
+        len -= list.front().size();
+        list = list.subspan(1);
+      }
+
+      if (len == 0)
+        continue;
+
+      auto rest = list.front().substr(len);
+      auto left = size_t(0);
+
+      auto i = send(id, rest, left);
+      sent += left;
+
+      if (i != status::OK)
+        return i;
+
+      list = list.subspan(1);
     }
+
+    return status::OK;
+  }
+
+  status send(uint id, std::string_view text) {
+    auto sent = size_t(0);
+    return send(id, text, sent);
+  }
 }
\ No newline at end of file
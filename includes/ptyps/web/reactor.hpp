@@ -0,0 +1,336 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <map>
+
+#include "../error.hpp"
+
+namespace ptyps::web::reactor {
+  using exception = ptyps::err::exception;
+  using clock = std::chrono::steady_clock;
+
+  // something that wants to hear about readiness on a file descriptor
+  class Handler {
+    public:
+      virtual void reactor_on_readable() { }
+      virtual void reactor_on_writable() { }
+  };
+
+  // One io thread: an epoll set, a queue of tasks posted from other
+  // threads and a set of timers. Handlers and timers only ever run on the
+  // loop's own thread, so anything registered with a loop is effectively
+  // single threaded.
+
+  class Loop {
+    private:
+      struct timer {
+        public:
+          uint64_t id;
+          clock::duration every;
+          std::function<bool()> func;
+      };
+
+      int epfd;
+      int wake;
+      std::atomic<bool> running = !0;
+      std::atomic<size_t> load = 0;
+      std::thread worker;
+      std::atomic<std::thread::id> self;
+
+      std::unordered_map<int, Handler*> handlers;
+
+      std::mutex lock;
+      std::vector<std::function<void()>> tasks;
+      std::vector<std::function<void()>> swap;
+
+      std::multimap<clock::time_point, timer> timers;
+      std::atomic<uint64_t> ids = 0;
+
+      // the timer being run, in case it cancels itself
+      uint64_t current = 0;
+      bool dropped = !1;
+
+      void drain() {
+        auto count = uint64_t();
+        [[maybe_unused]] auto i = ::read(wake, &count, sizeof(count));
+
+        {
+          auto guard = std::lock_guard(lock);
+          std::swap(tasks, swap);
+        }
+
+        for (auto &next : swap)
+          next();
+
+        swap.clear();
+      }
+
+      // runs due timers, returns how long epoll can sleep for
+      int expire() {
+        auto now = clock::now();
+
+        while (timers.size() && timers.begin()->first <= now) {
+          auto node = timers.extract(timers.begin());
+          auto &next = node.mapped();
+
+          current = next.id;
+          dropped = !1;
+
+          auto stop = next.func();
+
+          current = 0;
+
+          if (stop || dropped || next.every == clock::duration::zero())
+            continue;
+
+          node.key() = now + next.every;
+          timers.insert(std::move(node));
+        }
+
+        if (timers.empty())
+          return -1;
+
+        auto wait = timers.begin()->first - now;
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+
+        return std::max<int>(ms, 0);
+      }
+
+      void run() {
+        self = std::this_thread::get_id();
+
+        epoll_event events[64];
+
+        while (running) {
+          auto n = ::epoll_wait(epfd, events, std::size(events), expire());
+
+          for (auto i = 0; i < n; i++) {
+            auto fd = events[i].data.fd;
+
+            if (fd == wake) {
+              drain();
+              continue;
+            }
+
+            // handlers removed earlier in this batch are skipped
+            auto found = handlers.find(fd);
+
+            if (found == handlers.end())
+              continue;
+
+            auto flags = events[i].events;
+
+            if (flags & (EPOLLIN | EPOLLERR | EPOLLHUP))
+              found->second->reactor_on_readable();
+
+            found = handlers.find(fd);
+
+            if (found != handlers.end() && (flags & EPOLLOUT))
+              found->second->reactor_on_writable();
+          }
+        }
+      }
+
+      uint64_t schedule(clock::duration wait, clock::duration every, std::function<bool()> func) {
+        auto id = ++ids;
+
+        run_here([this, id, wait, every, func]() {
+          timers.insert({clock::now() + wait, timer({id, every, func})});
+        });
+
+        return id;
+      }
+
+    public:
+      Loop() {
+        epfd = ::epoll_create1(EPOLL_CLOEXEC);
+        wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (epfd == EOF || wake == EOF)
+          throw exception("unable to create event loop");
+
+        auto event = epoll_event();
+
+        event.events = EPOLLIN;
+        event.data.fd = wake;
+
+        ::epoll_ctl(epfd, EPOLL_CTL_ADD, wake, &event);
+
+        worker = std::thread([this]() {
+          run();
+        });
+      }
+
+      Loop(const Loop &) = delete;
+
+      ~Loop() {
+        running = !1;
+        post([]() { });
+
+        if (worker.joinable())
+          worker.join();
+
+        ::close(epfd);
+        ::close(wake);
+      }
+
+      // whether the caller is this loop's thread
+      bool here() {
+        return std::this_thread::get_id() == self;
+      }
+
+      // sockets registered, used to spread new ones across loops
+      size_t size() {
+        return load;
+      }
+
+      void post(std::function<void()> func) {
+        {
+          auto guard = std::lock_guard(lock);
+          tasks.push_back(std::move(func));
+        }
+
+        auto one = uint64_t(1);
+        [[maybe_unused]] auto i = ::write(wake, &one, sizeof(one));
+      }
+
+      // runs func right away when called on the loop, otherwise posts it
+      void run_here(std::function<void()> func) {
+        if (here())
+          return func();
+
+        post(std::move(func));
+      }
+
+      // like run_here, but waits for func to have run
+      void run_sync(std::function<void()> func) {
+        if (here())
+          return func();
+
+        auto done = std::promise<void>();
+        auto future = done.get_future();
+
+        post([&]() {
+          func();
+          done.set_value();
+        });
+
+        future.wait();
+      }
+
+      // the following three have to be called on the loop's thread
+
+      void add(int fd, Handler* handler, bool writable = !1) {
+        auto event = epoll_event();
+
+        event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+        event.data.fd = fd;
+
+        if (::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == EOF)
+          throw exception("unable to watch socket");
+
+        handlers[fd] = handler;
+        load++;
+      }
+
+      void modify(int fd, bool writable) {
+        auto event = epoll_event();
+
+        event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+        event.data.fd = fd;
+
+        ::epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event);
+      }
+
+      void remove(int fd) {
+        if (!handlers.erase(fd))
+          return;
+
+        ::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        load--;
+      }
+
+      // timers, safe to set and cancel from any thread. every() keeps going
+      // until func returns true, the same as thread::interval_run
+
+      template <typename T, typename D>
+        uint64_t after(std::chrono::duration<T, D> wait, std::function<void()> func) {
+          return schedule(wait, clock::duration::zero(), [func]() -> bool {
+            func();
+            return !0;
+          });
+        }
+
+      template <typename T, typename D>
+        uint64_t every(std::chrono::duration<T, D> time, std::function<bool()> func) {
+          return schedule(time, time, func);
+        }
+
+      void cancel(uint64_t id) {
+        run_here([this, id]() {
+          if (id == current)
+            dropped = !0;
+
+          std::erase_if(timers, [id](auto &next) {
+            return next.second.id == id;
+          });
+        });
+      }
+  };
+
+  // A fixed set of loops that sockets are spread across.
+
+  class Reactor {
+    private:
+      std::vector<std::unique_ptr<Loop>> loops;
+      std::atomic<size_t> turn = 0;
+
+    public:
+      Reactor(size_t threads) {
+        for (auto i = size_t(0); i < std::max<size_t>(threads, 1); i++)
+          loops.push_back(std::make_unique<Loop>());
+      }
+
+      // the loop with the fewest sockets on it; sockets only count once
+      // they're connecting, so a burst of them takes turns between equals
+      Loop &pick() {
+        auto start = turn++;
+        auto best = loops[start % loops.size()].get();
+
+        for (auto i = size_t(1); i < loops.size(); i++) {
+          auto next = loops[(start + i) % loops.size()].get();
+
+          if (next->size() < best->size())
+            best = next;
+        }
+
+        return *best;
+      }
+
+      size_t size() {
+        return loops.size();
+      }
+  };
+
+  // io threads the shared reactor starts with, change before first use
+  static size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 4);
+
+  Reactor &shared() {
+    static auto out = Reactor(threads);
+    return out;
+  }
+}
@@ -0,0 +1,828 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+#include <openssl/evp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <unordered_map>
+#include <memory>
+#include <deque>
+
+#include "../json.hpp"
+#include "../etf.hpp"
+#include "../zlib.hpp"
+#include "../random.hpp"
+#include "./reactor.hpp"
+#include "./ssl.hpp"
+#include "./ws.hpp"
+
+// A stand-in for wss://gateway.discord.gg that runs locally, so Gateway
+// can be driven (and timed) without Discord. It speaks enough of the
+// gateway protocol for a client to get through HELLO, IDENTIFY or RESUME
+// and heartbeating, then sends dispatches at a set rate. Every dispatch
+// carries the time it was sent (d.sim_sent, steady clock nanoseconds) so
+// the client can tell how long it took to reach its handler.
+
+namespace ptyps::web::simulator {
+  using exception = ptyps::err::exception;
+  using clock = std::chrono::steady_clock;
+
+  struct options {
+    public:
+      uint16_t port = 8443;      // 0 for any free port
+      uint heartbeat = 41250;    // heartbeat_interval given in HELLO, ms
+      bool ack = !0;             // off to leave heartbeats unanswered
+      uint guilds = 1;           // GUILD_CREATEs after READY
+      uint members = 100;        // members in each of them
+      double rate = 1000;        // MESSAGE_CREATEs a second, per session
+      uint64_t events = 10000;   // MESSAGE_CREATEs per session, 0 for no end
+      size_t content = 64;       // bytes of content in each message
+      uint64_t reconnect = 0;    // ask for a reconnect every this many, 0 for never
+      uint64_t invalidate = 0;   // invalidate the session after this many, 0 for never
+      uint64_t drop = 0;         // hang up with a reset after this many, losing what's in flight
+      size_t history = 4096;     // dispatches kept per session for RESUME
+      size_t backlog = 16 << 20; // bytes a slow client can have queued before dispatches wait
+      uint shards = 1;           // shards GET /gateway/bot recommends
+      uint concurrency = 1;      // and its max_concurrency
+      uint deflate = 0;          // 1 to agree to permessage-deflate, 2 without our context takeover
+  };
+
+  // the stamp put in every dispatch as sim_sent
+  int64_t stamp() {
+    auto now = clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+  }
+
+  // -----
+
+  // A throwaway self-signed certificate for localhost and 127.0.0.1.
+
+  class Certificate {
+    private:
+      EVP_PKEY* key = nullptr;
+      X509* cert = nullptr;
+
+    public:
+      Certificate() {
+        key = ::EVP_EC_gen("P-256");
+        cert = ::X509_new();
+
+        if (!key || !cert)
+          throw exception("unable to create certificate");
+
+        ::X509_set_version(cert, 2);
+        ::ASN1_INTEGER_set(::X509_get_serialNumber(cert), ptyps::random::word() >> 1);
+        ::X509_gmtime_adj(::X509_getm_notBefore(cert), -60);
+        ::X509_gmtime_adj(::X509_getm_notAfter(cert), 7 * 24 * 3600);
+        ::X509_set_pubkey(cert, key);
+
+        auto name = ::X509_get_subject_name(cert);
+        ::X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const u_char*) "localhost", -1, -1, 0);
+        ::X509_set_issuer_name(cert, name);
+
+        auto ctx = X509V3_CTX();
+        X509V3_set_ctx_nodb(&ctx);
+        ::X509V3_set_ctx(&ctx, cert, cert, nullptr, nullptr, 0);
+
+        auto ext = ::X509V3_EXT_conf_nid(nullptr, &ctx, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+
+        if (!ext)
+          throw exception("unable to create certificate");
+
+        ::X509_add_ext(cert, ext, -1);
+        ::X509_EXTENSION_free(ext);
+
+        if (!::X509_sign(cert, key, ::EVP_sha256()))
+          throw exception("unable to sign certificate");
+      }
+
+      Certificate(const Certificate &) = delete;
+
+      ~Certificate() {
+        ::X509_free(cert);
+        ::EVP_PKEY_free(key);
+      }
+
+      X509* x509() {
+        return cert;
+      }
+
+      EVP_PKEY* private_key() {
+        return key;
+      }
+
+      // writes the certificate out as PEM, for clients to trust
+      void save(const std::string &path) {
+        auto file = ::fopen(path.c_str(), "w");
+
+        if (!file)
+          throw exception("unable to save certificate");
+
+        ::PEM_write_X509(file, cert);
+        ::fclose(file);
+      }
+  };
+
+  // -----
+
+  // counters across every connection, fine to read from any thread
+  struct stats {
+    public:
+      std::atomic<uint64_t> connections = 0;
+      std::atomic<uint64_t> identifies = 0;
+      std::atomic<uint64_t> resumes = 0;
+      std::atomic<uint64_t> replayed = 0;
+      std::atomic<uint64_t> invalidated = 0;
+      std::atomic<uint64_t> heartbeats = 0;
+      std::atomic<uint64_t> dispatched = 0;
+      std::atomic<uint64_t> bytes = 0;
+  };
+
+  struct session {
+    public:
+      uint64_t seq = 0;
+      uint64_t messages = 0;
+
+      // recent dispatches, replayed to a client that resumes
+      std::deque<std::pair<uint64_t, std::string>> log;
+  };
+
+  // what every connection shares; apart from the counters it's only
+  // touched on the server's io thread
+  struct world {
+    public:
+      options opts;
+      reactor::Loop* loop = nullptr;
+      stats counters;
+      std::unordered_map<std::string, session> sessions;
+
+      // forgets the connection on fd once the current event is done
+      std::function<void(int)> drop;
+  };
+
+  // -----
+
+  // One client connection: the tls handshake, the websocket upgrade and
+  // then the gateway protocol, all on the server's io thread.
+
+  class Peer final : public reactor::Handler {
+    private:
+      enum class phase {
+        HANDSHAKE,
+        UPGRADE,
+        OPEN,
+        CLOSED
+      };
+
+      world &shared;
+      int fd;
+      SSL* ssl;
+      phase at = phase::HANDSHAKE;
+
+      std::vector<char> inbox = std::vector<char>(ptyps::web::ssl::RECORD * 4);
+      std::string request;
+      ptyps::web::ws::Decoder decoder;
+
+      std::string out;
+      size_t offset = 0;
+      bool watching = !1;
+
+      bool etf = !1; // asked for encoding=etf, so frames are binary terms
+
+      // asked for compress=zlib-stream, one deflate stream for the connection
+      std::unique_ptr<ptyps::zlib::Deflater> zlib;
+
+      // permessage-deflate, if it was offered and opts.deflate agrees to it
+      std::unique_ptr<ptyps::zlib::Deflater> squeezer;
+      bool takeover = !0;
+
+      std::string id; // the session, once identified or resumed
+      uint64_t sent = 0;
+      uint64_t ticker = 0;
+      double owed = 0;
+
+      void watch(bool writable) {
+        if (watching == writable)
+          return;
+
+        watching = writable;
+        shared.loop->modify(fd, writable);
+      }
+
+      void flush() {
+        while (offset < out.size()) {
+          auto done = size_t(0);
+          auto i = ptyps::web::ssl::send(ssl, out.data() + offset, out.size() - offset, done);
+
+          offset += done;
+          shared.counters.bytes += done;
+
+          if (i == ptyps::web::ssl::status::FAIL)
+            return close();
+
+          if (i == ptyps::web::ssl::status::WAITING)
+            return watch(!0);
+        }
+
+        out.clear();
+        offset = 0;
+
+        watch(!1);
+      }
+
+      // payloads are written as json whatever the encoding, they're turned
+      // into terms and compressed on the way out
+      void queue(std::string_view payload, ptyps::web::ws::opcode op = ptyps::web::ws::opcode::TEXT) {
+        using opcode = ptyps::web::ws::opcode;
+
+        if (op != opcode::TEXT || (!etf && !zlib && !squeezer))
+          return void(out += ptyps::web::ws::encode(!1, op, payload));
+
+        auto data = etf ? ptyps::etf::encode(ptyps::json::parse(payload)) : std::string(payload);
+
+        if (etf || zlib)
+          op = opcode::BINARY;
+
+        // zlib-stream's flush is left on the end, as discord leaves it
+        if (zlib)
+          data = zlib->feed(data);
+
+        if (!squeezer)
+          return void(out += ptyps::web::ws::encode(!1, op, data));
+
+        auto packed = squeezer->message(data);
+        out += ptyps::web::ws::encode(!1, op, packed, !0);
+
+        if (!takeover)
+          squeezer->reset();
+      }
+
+      void send(std::string_view payload) {
+        queue(payload);
+        flush();
+      }
+
+      std::string dispatch(std::string_view event, std::string_view data) {
+        auto &s = shared.sessions[id];
+        auto seq = ++s.seq;
+
+        auto text = std::string(R"({"op":0,"s":)") + std::to_string(seq) + R"(,"t":")";
+
+        text += event;
+        text += R"(","d":)";
+        text += data;
+        text += "}";
+
+        s.log.push_back({seq, text});
+
+        if (s.log.size() > shared.opts.history)
+          s.log.pop_front();
+
+        shared.counters.dispatched++;
+
+        queue(text);
+        return text;
+      }
+
+      static std::string snowflake() {
+        return std::to_string((uint64_t(ptyps::random::word()) << 22) | ptyps::random::word());
+      }
+
+      void ready() {
+        auto &opts = shared.opts;
+
+        auto guilds = std::string();
+
+        for (auto i = uint(0); i < opts.guilds; i++)
+          guilds += (i ? "," : "") + std::string(R"({"id":")") + std::to_string(1000 + i) + R"(","unavailable":true})";
+
+        auto data = std::string(R"({"v":10,"user":{"id":"1","username":"simulator","discriminator":"0000","bot":true},)");
+
+        data += R"("session_id":")" + id + R"(",)";
+        data += R"("resume_gateway_url":"wss://127.0.0.1:)" + std::to_string(opts.port) + R"(",)";
+        data += R"("guilds":[)" + guilds + R"(],"application":{"id":"1","flags":0},)";
+        data += R"("sim_sent":)" + std::to_string(stamp()) + "}";
+
+        dispatch("READY", data);
+
+        for (auto i = uint(0); i < opts.guilds; i++) {
+          auto guild = std::to_string(1000 + i);
+
+          auto data = std::string(R"({"id":")") + guild + R"(","name":"guild )" + guild + R"(","member_count":)" + std::to_string(opts.members);
+
+          data += R"(,"roles":[{"id":")" + guild + R"(","name":"@everyone","permissions":"1024","position":0}])";
+          data += R"(,"channels":[{"id":")" + guild + R"(1","type":0,"name":"general"}],"members":[)";
+
+          for (auto m = uint(0); m < opts.members; m++) {
+            auto user = snowflake();
+
+            data += (m ? "," : "") + std::string(R"({"user":{"id":")") + user + R"(","username":"user)" + user + R"(","discriminator":"0001","avatar":null},)";
+            data += R"("roles":[],"joined_at":"2022-02-18T00:00:00.000000+00:00","deaf":false,"mute":false})";
+          }
+
+          data += R"(],"sim_sent":)" + std::to_string(stamp()) + "}";
+
+          dispatch("GUILD_CREATE", data);
+        }
+
+        flush();
+        start();
+      }
+
+      void message() {
+        auto &opts = shared.opts;
+        auto guild = std::to_string(1000 + ptyps::random::word() % std::max<uint>(opts.guilds, 1));
+
+        auto data = std::string(R"({"id":")") + snowflake() + R"(","channel_id":")" + guild + R"(1","guild_id":")" + guild + R"(",)";
+
+        data += R"("author":{"id":"2","username":"someone","discriminator":"0002","avatar":null},)";
+        data += R"("content":")" + std::string(opts.content, 'x') + R"(","timestamp":"2022-02-18T00:00:00.000000+00:00",)";
+        data += R"("tts":false,"mention_everyone":false,"mentions":[],"attachments":[],"embeds":[],"type":0,)";
+        data += R"("sim_sent":)" + std::to_string(stamp()) + "}";
+
+        dispatch("MESSAGE_CREATE", data);
+      }
+
+      // sends whatever's owed at the configured rate, once a millisecond
+      void start() {
+        shared.loop->cancel(ticker);
+
+        ticker = shared.loop->every(std::chrono::milliseconds(1), [this]() -> bool {
+          return tick();
+        });
+      }
+
+      bool tick() {
+        auto &opts = shared.opts;
+        auto &s = shared.sessions[id];
+
+        if (at != phase::OPEN)
+          return !0;
+
+        // a client that can't keep up gets nothing new until it catches up
+        if (out.size() - offset > opts.backlog)
+          return !1;
+
+        owed = std::min(owed + opts.rate / 1000.0, opts.rate);
+
+        while (owed >= 1) {
+          if (opts.events && s.messages >= opts.events)
+            break;
+
+          owed--;
+          s.messages++;
+          sent++;
+
+          message();
+
+          if (opts.reconnect && sent % opts.reconnect == 0) {
+            queue(R"({"op":7,"s":null,"t":null,"d":null})");
+            flush();
+            return !0;
+          }
+
+          // this tick's dispatches never make it out
+          if (opts.drop && sent % opts.drop == 0) {
+            hangup();
+            return !0;
+          }
+
+          if (opts.invalidate && sent % opts.invalidate == 0) {
+            queue(R"({"op":9,"s":null,"t":null,"d":false})");
+            shared.sessions.erase(id);
+            shared.counters.invalidated++;
+            flush();
+            return !0;
+          }
+        }
+
+        flush();
+
+        return opts.events && s.messages >= opts.events;
+      }
+
+      void recvd(std::string_view text) {
+        auto packet = ptyps::json::parse(text);
+        auto op = ptyps::json::value<int>(packet, "op");
+
+        if (op == 1) {
+          shared.counters.heartbeats++;
+
+          if (shared.opts.ack)
+            send(R"({"op":11,"s":null,"t":null,"d":null})");
+
+          return;
+        }
+
+        if (op == 2) {
+          if (id.size())
+            return close(4005);
+
+          char text[33];
+
+          ::snprintf(text, sizeof(text), "%08x%08x%08x%08x", ptyps::random::word(), ptyps::random::word(), ptyps::random::word(), ptyps::random::word());
+
+          id = text;
+
+          shared.sessions[id] = session();
+          shared.counters.identifies++;
+
+          return ready();
+        }
+
+        if (op == 6) {
+          auto wanted = ptyps::json::value<std::string>(packet, "d.session_id");
+          auto seq = ptyps::json::value<uint64_t>(packet, "d.seq").value_or(0);
+
+          auto found = wanted ? shared.sessions.find(*wanted) : shared.sessions.end();
+
+          if (found == shared.sessions.end()) {
+            shared.counters.invalidated++;
+            return send(R"({"op":9,"s":null,"t":null,"d":false})");
+          }
+
+          id = *wanted;
+          shared.counters.resumes++;
+
+          for (auto &[n, text] : found->second.log) {
+            if (n <= seq)
+              continue;
+
+            queue(text);
+            shared.counters.replayed++;
+          }
+
+          dispatch("RESUMED", R"({"sim_sent":)" + std::to_string(stamp()) + "}");
+
+          flush();
+          return start();
+        }
+      }
+
+      void upgrade(std::string_view data) {
+        request.append(data);
+
+        auto end = request.find("\r\n\r\n");
+
+        if (end == std::string::npos) {
+          if (request.size() > 8192)
+            close();
+
+          return;
+        }
+
+        auto head = std::string_view(request).substr(0, end + 2);
+        auto key = std::string_view();
+        auto extensions = std::string_view();
+
+        if (head.starts_with("GET /gateway/bot"))
+          return recommend();
+
+        while (head.size()) {
+          auto eol = head.find("\r\n");
+          auto line = head.substr(0, eol);
+          auto colon = line.find(':');
+
+          if (colon != std::string_view::npos && ptyps::web::http::same(line.substr(0, colon), "Sec-WebSocket-Key"))
+            key = ptyps::web::http::trim(line.substr(colon + 1));
+
+          if (colon != std::string_view::npos && ptyps::web::http::same(line.substr(0, colon), "Sec-WebSocket-Extensions"))
+            extensions = ptyps::web::http::trim(line.substr(colon + 1));
+
+          head.remove_prefix(eol + 2);
+        }
+
+        if (key.empty())
+          return close();
+
+        auto line = request.substr(0, request.find("\r\n"));
+
+        etf = line.find("encoding=etf") != std::string::npos;
+
+        if (line.find("compress=zlib-stream") != std::string::npos)
+          zlib = std::make_unique<ptyps::zlib::Deflater>();
+
+        auto reply = std::string("HTTP/1.1 101 Switching Protocols\r\n");
+
+        reply += "Upgrade: websocket\r\n";
+        reply += "Connection: Upgrade\r\n";
+        reply += "Sec-WebSocket-Accept: " + ptyps::web::ws::createAcceptKey(key) + "\r\n";
+
+        // the offer's parameters are taken as asked, windows are left at 15
+        if (shared.opts.deflate && extensions.starts_with(ptyps::web::ws::PERMESSAGE_DEFLATE)) {
+          auto agreed = std::string(ptyps::web::ws::PERMESSAGE_DEFLATE);
+
+          takeover = shared.opts.deflate == 1 && extensions.find("server_no_context_takeover") == std::string_view::npos;
+
+          if (!takeover)
+            agreed += "; server_no_context_takeover";
+
+          if (extensions.find("client_no_context_takeover") != std::string_view::npos)
+            agreed += "; client_no_context_takeover";
+
+          reply += "Sec-WebSocket-Extensions: " + agreed + "\r\n";
+
+          squeezer = ptyps::zlib::deflaters.take(-15, Z_DEFAULT_COMPRESSION);
+
+          decoder.deflate = !0;
+          decoder.takeover = agreed.find("client_no_context_takeover") == std::string::npos;
+        }
+
+        reply += "\r\n";
+
+        out += reply;
+
+        at = phase::OPEN;
+
+        queue(R"({"op":10,"s":null,"t":null,"d":{"heartbeat_interval":)" + std::to_string(shared.opts.heartbeat) + "}}");
+        flush();
+
+        // frames that followed the request in the same read
+        auto rest = request.substr(end + 4);
+
+        request.clear();
+
+        if (rest.size())
+          frames(rest);
+      }
+
+      // answers GET /gateway/bot, then hangs up
+      void recommend() {
+        auto &opts = shared.opts;
+
+        auto body = std::string(R"({"url":"wss://127.0.0.1:)") + std::to_string(opts.port) + "\",";
+
+        body += R"("shards":)" + std::to_string(opts.shards) + ",";
+        body += R"("session_start_limit":{"total":1000,"remaining":1000,"reset_after":0,)";
+        body += R"("max_concurrency":)" + std::to_string(opts.concurrency) + "}}";
+
+        out += "HTTP/1.1 200 OK\r\n";
+        out += "Content-Type: application/json\r\n";
+        out += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        out += "Connection: close\r\n\r\n";
+        out += body;
+
+        flush();
+        close();
+      }
+
+      void frames(std::string_view data) {
+        using opcode = ptyps::web::ws::opcode;
+
+        auto error = decoder.feed(data, [&](opcode op, ptyps::web::ws::decode_variant vari, bool) {
+          if (at != phase::OPEN)
+            return;
+
+          if (op == opcode::CLOSE)
+            return close(1000);
+
+          if (op == opcode::PING) {
+            queue(std::get<std::string_view>(vari), opcode::PONG);
+            return flush();
+          }
+
+          if (op == opcode::TEXT)
+            recvd(std::get<std::string_view>(vari));
+
+          if (op == opcode::BINARY) {
+            auto term = ptyps::etf::decode(std::get<std::string_view>(vari));
+
+            if (!term)
+              return close(4002);
+
+            recvd(ptyps::json::stringify(ptyps::etf::to_json(*term)));
+          }
+        });
+
+        if (error)
+          close(uint16_t(*error));
+      }
+
+      void handshake() {
+        auto i = ::SSL_do_handshake(ssl);
+
+        if (i == 1) {
+          at = phase::UPGRADE;
+          return watch(!1);
+        }
+
+        auto err = ::SSL_get_error(ssl, i);
+
+        if (err == SSL_ERROR_WANT_READ)
+          return watch(!1);
+
+        if (err == SSL_ERROR_WANT_WRITE)
+          return watch(!0);
+
+        close();
+      }
+
+    public:
+      Peer(world &shared, int fd, SSL_CTX* ctx) : shared(shared), fd(fd) {
+        ssl = ::SSL_new(ctx);
+
+        ::SSL_set_fd(ssl, fd);
+        ::SSL_set_accept_state(ssl);
+        ::SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+        shared.counters.connections++;
+      }
+
+      ~Peer() {
+        close();
+
+        ptyps::zlib::deflaters.give(std::move(squeezer), -15, Z_DEFAULT_COMPRESSION);
+      }
+
+      // code is sent in a close frame first, if there's a websocket to send it on
+      void close(std::optional<uint16_t> code = {}) {
+        if (at == phase::CLOSED)
+          return;
+
+        if (code && at == phase::OPEN) {
+          uint8_t payload[2];
+
+          ptyps::web::ws::UInt16ToUInt8(*code, payload);
+          queue(std::string_view((char *) payload, 2), ptyps::web::ws::opcode::CLOSE);
+
+          auto done = size_t(0);
+          ptyps::web::ssl::send(ssl, out.data() + offset, out.size() - offset, done);
+        }
+
+        at = phase::CLOSED;
+
+        shared.loop->cancel(ticker);
+        shared.loop->remove(fd);
+
+        ptyps::web::ssl::close(ssl);
+        ::close(fd);
+
+        shared.drop(fd);
+      }
+
+      // as a dropped connection would, whatever the kernel still had to send
+      // is thrown away and has to be replayed
+      void hangup() {
+        auto linger = ::linger{1, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+        close();
+      }
+
+      void reactor_on_readable() {
+        using pwse = ptyps::web::ssl::event;
+
+        if (at == phase::HANDSHAKE)
+          return handshake();
+
+        while (at != phase::CLOSED) {
+          auto vari = ptyps::web::ssl::recv(ssl, inbox);
+
+          if (std::holds_alternative<pwse>(vari)) {
+            auto event = std::get<pwse>(vari);
+
+            if (event == pwse::WAITING || event == pwse::STALLED)
+              break;
+
+            return close();
+          }
+
+          auto data = std::get<std::string_view>(vari);
+
+          if (at == phase::UPGRADE)
+            upgrade(data);
+
+          else if (at == phase::OPEN)
+            frames(data);
+        }
+      }
+
+      void reactor_on_writable() {
+        if (at == phase::HANDSHAKE)
+          return handshake();
+
+        flush();
+      }
+  };
+
+  // -----
+
+  // Listens on 127.0.0.1 and runs every connection on an io thread of its
+  // own, apart from the shared reactor the clients use.
+
+  class Server : public reactor::Handler {
+    private:
+      std::shared_ptr<Certificate> cert;
+      SSL_CTX* ctx;
+      int listener;
+
+      world shared;
+      std::unordered_map<int, std::unique_ptr<Peer>> peers;
+
+      reactor::Reactor io = reactor::Reactor(1);
+
+    public:
+      Server(options opts, std::shared_ptr<Certificate> cert = std::make_shared<Certificate>()) : cert(cert) {
+        ptyps::web::ssl::init();
+
+        ctx = ::SSL_CTX_new(::TLS_server_method());
+
+        if (!ctx || !::SSL_CTX_use_certificate(ctx, cert->x509()) || !::SSL_CTX_use_PrivateKey(ctx, cert->private_key()))
+          throw exception("unable to set up server tls");
+
+        listener = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        auto one = 1;
+        ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        auto addr = sockaddr_in();
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opts.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (::bind(listener, (sockaddr *) &addr, sizeof(addr)) == EOF || ::listen(listener, 1024) == EOF)
+          throw exception("unable to listen");
+
+        auto len = socklen_t(sizeof(addr));
+        ::getsockname(listener, (sockaddr *) &addr, &len);
+
+        opts.port = ntohs(addr.sin_port);
+
+        shared.opts = opts;
+        shared.loop = &io.pick();
+
+        shared.drop = [this](int fd) {
+          auto found = peers.find(fd);
+
+          if (found == peers.end())
+            return;
+
+          // not deleted right here, it's likely what called us
+          auto peer = found->second.release();
+          peers.erase(found);
+
+          shared.loop->post([peer]() {
+            delete peer;
+          });
+        };
+
+        shared.loop->run_sync([this]() {
+          shared.loop->add(listener, this);
+        });
+      }
+
+      Server(const Server &) = delete;
+
+      ~Server() {
+        shared.loop->run_sync([this]() {
+          shared.loop->remove(listener);
+
+          while (peers.size())
+            peers.begin()->second->close();
+        });
+
+        ::close(listener);
+        ::SSL_CTX_free(ctx);
+      }
+
+      void reactor_on_readable() {
+        while (!0) {
+          auto fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+          if (fd == EOF)
+            return;
+
+          auto one = 1;
+          ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+          auto peer = std::make_unique<Peer>(shared, fd, ctx);
+
+          shared.loop->add(fd, peer.get());
+          peers[fd] = std::move(peer);
+        }
+      }
+
+      uint16_t port() {
+        return shared.opts.port;
+      }
+
+      // where a client should connect to
+      std::string url() {
+        return "wss://127.0.0.1:" + std::to_string(port()) + "/?v=10&encoding=json";
+      }
+
+      stats &counters() {
+        return shared.counters;
+      }
+
+      Certificate &certificate() {
+        return *cert;
+      }
+  };
+}
@@ -7,16 +7,26 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#include <unordered_map>
 #include <optional>
+#include <csignal>
+#include <string>
+#include <mutex>
+#include <cstring>
+#include <string_view>
 #include <variant>
 #include <vector>
+#include <span>
 
 namespace ptyps::web::ssl {
   using exception = ptyps::err::exception;
 
   enum class status {
     FAIL = EOF,
-    OK
+    OK,
+    WAITING // the socket has to become writable before the rest can go
   };
 
   static bool initialized = !1;
@@ -29,27 +39,257 @@ namespace ptyps::web::ssl {
     OpenSSL_add_all_algorithms();
     SSL_load_error_strings();
 
+    // tls writes go through plain write(), so a peer that's gone would
+    // otherwise kill the process instead of failing the write
+    ::signal(SIGPIPE, SIG_IGN);
+
     initialized = !0;
   }
   
-  std::optional<SSL*> open(uint id) {
-    init();
+  // settings for the client context, change before the first connection
+  struct options {
+    public:
+      std::string ciphers = ""; // tls 1.2 cipher list, empty for openssl's default
+      std::string suites = ""; // tls 1.3 ciphersuites, same
+      std::vector<std::string> alpn = {"http/1.1"};
+      std::string ca_file = ""; // empty for the system's store
+      std::string ca_path = "";
+      bool verify = !0;
+      bool resume = !0;
+  };
+
+  static options settings;
+
+  // One client SSL_CTX for the whole process. The CA store, ciphers and
+  // ALPN are set up once, and the last session each host handed us is kept
+  // so that reconnects (and other shards to the same host) can resume it
+  // rather than go through a full handshake.
+
+  class Context {
+    private:
+      SSL_CTX* ctx;
+
+      std::mutex lock;
+      std::unordered_map<std::string, SSL_SESSION*> sessions;
+
+      // openssl hands over new sessions (tls 1.3 tickets arrive after the
+      // handshake) here; returning 1 means we keep the reference
+      static int on_session(SSL* ssl, SSL_SESSION* session);
+
+    public:
+      Context(const options &opts) {
+        init();
+
+        ctx = ::SSL_CTX_new(TLS_client_method());
+
+        if (!ctx)
+          throw exception("unable to create ssl context");
+
+        ::SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+        if (opts.ciphers.size() && !::SSL_CTX_set_cipher_list(ctx, opts.ciphers.c_str()))
+          throw exception("invalid ssl cipher list");
+
+        if (opts.suites.size() && !::SSL_CTX_set_ciphersuites(ctx, opts.suites.c_str()))
+          throw exception("invalid tls 1.3 ciphersuites");
+
+        if (opts.alpn.size()) {
+          auto wire = std::string();
+
+          for (auto &next : opts.alpn) {
+            wire += char(next.size());
+            wire += next;
+          }
+
+          // unlike most of openssl, this one returns 0 on success
+          if (::SSL_CTX_set_alpn_protos(ctx, (const u_char*) wire.data(), wire.size()))
+            throw exception("invalid alpn protocols");
+        }
 
-    auto method = TLS_client_method();
-    auto context = SSL_CTX_new(method);
-    auto ssl = SSL_new(context);
+        if (opts.verify) {
+          auto file = opts.ca_file.size() ? opts.ca_file.c_str() : nullptr;
+          auto path = opts.ca_path.size() ? opts.ca_path.c_str() : nullptr;
+
+          auto i = file || path
+            ? ::SSL_CTX_load_verify_locations(ctx, file, path)
+            : ::SSL_CTX_set_default_verify_paths(ctx);
+
+          if (!i)
+            throw exception("unable to load ca certificates");
+
+          ::SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+        }
+
+        if (opts.resume) {
+          // we keep the sessions ourselves, keyed by host
+          ::SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+          ::SSL_CTX_sess_set_new_cb(ctx, on_session);
+        }
+
+        else
+          ::SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+      }
+
+      Context(const Context &) = delete;
+
+      ~Context() {
+        forget();
+        ::SSL_CTX_free(ctx);
+      }
+
+      SSL_CTX* get() {
+        return ctx;
+      }
+
+      void store(const std::string &host, SSL_SESSION* session) {
+        auto guard = std::lock_guard(lock);
+        auto &slot = sessions[host];
+
+        if (slot)
+          ::SSL_SESSION_free(slot);
+
+        slot = session;
+      }
+
+      // puts the last session for host on ssl, if there's one worth trying
+      bool offer(SSL* ssl, const std::string &host) {
+        auto guard = std::lock_guard(lock);
+        auto found = sessions.find(host);
+
+        if (found == sessions.end())
+          return !1;
+
+        if (!::SSL_SESSION_is_resumable(found->second)) {
+          ::SSL_SESSION_free(found->second);
+          sessions.erase(found);
+          return !1;
+        }
+
+        return ::SSL_set_session(ssl, found->second) == 1;
+      }
+
+      // drops every cached session, or just the one for host
+      void forget(const std::string &host = "") {
+        auto guard = std::lock_guard(lock);
+
+        std::erase_if(sessions, [&](auto &next) {
+          if (host.size() && next.first != host)
+            return !1;
+
+          ::SSL_SESSION_free(next.second);
+          return !0;
+        });
+      }
+  };
+
+  Context &client() {
+    static auto out = Context(settings);
+    return out;
+  }
+
+  // where each SSL keeps the host its sessions get filed under
+  int key_index() {
+    static auto out = ::CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_SSL, 0, nullptr, nullptr, nullptr,
+      [](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+        ::free(ptr);
+      });
+
+    return out;
+  }
+
+  int Context::on_session(SSL* ssl, SSL_SESSION* session) {
+    auto host = (const char*) ::SSL_get_ex_data(ssl, key_index());
+
+    if (!host)
+      return 0;
+
+    client().store(host, session);
+    return 1;
+  }
+
+  // host is used for SNI, certificate checks and finding a session to resume.
+  // ktls asks openssl to hand the record layer to the kernel once the
+  // handshake is done, where the kernel and cipher allow it
+  std::optional<SSL*> open(uint id, std::string host = "", bool ktls = !1) {
+    auto &context = client();
+    auto ssl = SSL_new(context.get());
 
     if (!ssl)
       return {};
 
     auto i = ::SSL_set_fd(ssl, id);
 
-    if (i == 0)
+    if (i == 0) {
+      ::SSL_free(ssl);
       return {};
+    }
+
+    if (host.size()) {
+      auto buf = in6_addr();
+      auto literal = ::inet_pton(AF_INET, host.c_str(), &buf) == 1 || ::inet_pton(AF_INET6, host.c_str(), &buf) == 1;
+
+      // sni is only for names, addresses get checked against the cert's ip
+      if (!literal)
+        ::SSL_set_tlsext_host_name(ssl, host.c_str());
+
+      if (settings.verify && !literal)
+        ::SSL_set1_host(ssl, host.c_str());
+
+      if (settings.verify && literal)
+        ::X509_VERIFY_PARAM_set1_ip_asc(::SSL_get0_param(ssl), host.c_str());
+
+      if (settings.resume) {
+        ::SSL_set_ex_data(ssl, key_index(), ::strdup(host.c_str()));
+        context.offer(ssl, host);
+      }
+    }
+
+    // a write that stalls is retried from wherever the unsent bytes have
+    // been moved to, not the buffer it started in. partial writes make
+    // SSL_write report each record as it goes, so a stall never leaves
+    // more than one record pending and the retry can be any size above it
+    ::SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+    if (ktls)
+      ::SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
 
     return ssl;
   }
 
+  // Says goodbye (close_notify) without waiting for the peer's and frees
+  // the connection. Freeing one that was never shut down makes openssl
+  // treat its session as bad, which would rule out resuming it later.
+  void close(SSL* id) {
+    ::SSL_shutdown(id);
+    ::SSL_free(id);
+  }
+
+  // which directions the kernel is doing the record layer for
+  enum class offload {
+    NONE,
+    SEND,
+    RECV,
+    BOTH
+  };
+
+  offload offloaded(SSL* id) {
+    auto send = BIO_get_ktls_send(::SSL_get_wbio(id)) > 0;
+    auto recv = BIO_get_ktls_recv(::SSL_get_rbio(id)) > 0;
+
+    if (send && recv)
+      return offload::BOTH;
+
+    if (send)
+      return offload::SEND;
+
+    return recv ? offload::RECV : offload::NONE;
+  }
+
+  // whether the handshake resumed an earlier session
+  bool resumed(SSL* id) {
+    return ::SSL_session_reused(id) == 1;
+  }
+
   status connect(SSL* id) {
     auto i = ::SSL_connect(id);
     auto err = ::SSL_get_error(id, i);
@@ -60,56 +300,162 @@ namespace ptyps::web::ssl {
     return status::FAIL;
   }
 
+  // where a non-blocking handshake has got to
+  enum class progress {
+    FAIL = EOF,
+    DONE,
+    READING, // wait for the socket to be readable and try again
+    WRITING  // the same, but writable
+  };
+
+  progress handshake(SSL* id) {
+    auto i = ::SSL_connect(id);
+
+    if (i == 1)
+      return progress::DONE;
+
+    auto err = ::SSL_get_error(id, i);
+
+    if (err == SSL_ERROR_WANT_READ)
+      return progress::READING;
+
+    if (err == SSL_ERROR_WANT_WRITE)
+      return progress::WRITING;
+
+    return progress::FAIL;
+  }
+
   enum class event {
     ERROR = EOF,
     WAITING,
-    DISCONNECTED
+    DISCONNECTED,
+    STALLED // tls needs the socket writable before it can read any more
   };
 
-  std::variant<event, std::string> recv(SSL* id, uint size = 1024) {
-    std::vector<char> buffer(size);
-    std::string recvd;
-    int len = 0;
-
-    while (!0) {
-      auto i = ::SSL_read(id, &buffer[0], size);
-      auto err = ::SSL_get_error(id, i);
+  constexpr size_t RECORD = 16384; // largest tls record payload
 
-      if (i == EOF) {
-        if (err == SSL_ERROR_WANT_READ)
-          return event::WAITING;
+  // Reads straight into into, record after record, until it's full or tls
+  // has nothing more to give. What was read comes back as a view of into;
+  // a wait or error is only reported once there's no data to hand over.
+  std::variant<event, std::string_view> recv(SSL* id, std::span<char> into) {
+    auto used = size_t(0);
 
-        if (err == SSL_ERROR_SYSCALL)
-          return event::DISCONNECTED;
+    while (used < into.size()) {
+      auto got = size_t(0);
 
-        return event::ERROR;
+      if (::SSL_read_ex(id, into.data() + used, into.size() - used, &got) == 1) {
+        used += got;
+        continue;
       }
 
-      auto begin = ptyps::iter::begin(buffer, 0);
-      auto end = ptyps::iter::begin(buffer, i);
+      if (used)
+        break;
 
-      recvd += std::string(begin, end);
-      buffer.clear();
-      len += i;
+      auto err = ::SSL_get_error(id, 0);
 
-      if (i < size)
-        return recvd;
+      if (err == SSL_ERROR_WANT_READ)
+        return event::WAITING;
+
+      if (err == SSL_ERROR_WANT_WRITE)
+        return event::STALLED;
+
+      if (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_ZERO_RETURN)
+        return event::DISCONNECTED;
+
+      return event::ERROR;
     }
+
+    return std::string_view(into.data(), used);
   }
 
-  status send(SSL* id, std::string data) {
-    while (data.size()) {
-      auto len = ::SSL_write(id, &data[0], data.size());
-      auto err = ::SSL_get_error(id, len);
+  // sent is bumped by however much made it out, including on WAITING
+  status send(SSL* id, const char* data, size_t size, size_t &sent) {
+    auto pos = size_t(0);
+
+    while (pos < size) {
+      auto len = ::SSL_write(id, data + pos, size - pos);
+
+      if (len <= 0) {
+        auto err = ::SSL_get_error(id, len);
+
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+          return status::WAITING;
 
-      if (err)
         return status::FAIL;
+      }
+
+      pos += len;
+      sent += len;
+    }
+
+    return status::OK;
+  }
+
+  // straight from a file to the socket, only with the send side offloaded
+  status sendfile(SSL* id, int file, off_t offset, size_t size, size_t &sent) {
+    while (size) {
+      auto len = ::SSL_sendfile(id, file, offset, size, 0);
 
-      auto begin = std::begin(data);
+      if (len <= 0) {
+        auto err = ::SSL_get_error(id, len);
 
-      data.erase(begin, begin + len);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+          return status::WAITING;
+
+        return status::FAIL;
+      }
+
+      offset += len;
+      size -= len;
+      sent += len;
     }
 
     return status::OK;
   }
+
+  status send(SSL* id, std::string data) {
+    auto sent = size_t(0);
+    return send(id, data.data(), data.size(), sent);
+  }
+
+  // Sends a list of buffers as if they were one. Small buffers are packed
+  // into a record sized staging area so that a frame header and its payload
+  // (or several small frames) leave in a single SSL_write; anything that
+  // doesn't fit once the staging area is full gets written directly.
+  status send(SSL* id, std::span<const std::string_view> list, size_t &sent) {
+    char staging[RECORD];
+    auto used = size_t(0);
+
+    for (auto next : list) {
+      auto take = std::min(next.size(), RECORD - used);
+
+      std::memcpy(staging + used, next.data(), take);
+      used += take;
+      next.remove_prefix(take);
+
+      if (next.empty())
+        continue;
+
+      auto i = send(id, staging, used, sent);
+
+      if (i != status::OK)
+        return i;
+
+      used = 0;
+
+      if (next.size() >= RECORD) {
+        i = send(id, next.data(), next.size(), sent);
+
+        if (i != status::OK)
+          return i;
+
+        continue;
+      }
+
+      std::memcpy(staging, next.data(), next.size());
+      used = next.size();
+    }
+
+    return send(id, staging, used, sent);
+  }
 }
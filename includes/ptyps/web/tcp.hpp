@@ -3,23 +3,557 @@
 // Copyright (C) 2022 Dave Perry (dbdii407)
 
 #include "../thread.hpp"
+#include "../queue.hpp"
+#include "./reactor.hpp"
 #include "./net.hpp"
+#include "./dns.hpp"
 #include "./ssl.hpp"
 
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <deque>
 #include <fcntl.h>
+#include <mutex>
 
 namespace ptyps::web::tcps {
   using exception = ptyps::err::exception;
 
-  class Socket {
+  // what to do when a writer finds more than the high water mark queued
+  enum class pressure {
+    NOTIFY, // carry on queueing, tcp_on_backpressure says when to slow down
+    BLOCK   // wait until the queue is half drained (never from the io thread)
+  };
+
+  // a queued write, typically a frame header and its payload
+  struct packet {
+    public:
+      std::string head;
+      std::string body;
+  };
+
+  // how far a connect has got
+  enum class phase {
+    IDLE,
+    RESOLVING,
+    CONNECTING,
+    HANDSHAKING,
+    OPEN
+  };
+
+  // how long each phase of the last connect took
+  struct timings {
+    public:
+      std::chrono::microseconds resolve = {};
+      std::chrono::microseconds connect = {};
+      std::chrono::microseconds handshake = {};
+      std::chrono::microseconds upgrade = {}; // filled in by wss
+  };
+
+  class Socket : public ptyps::web::reactor::Handler {
     private:
+      using clock = ptyps::web::reactor::clock;
+
+      // one of the sockets racing to connect, until the race is settled
+      class Attempt : public ptyps::web::reactor::Handler {
+        public:
+          Socket* owner;
+          uint fd;
+
+          Attempt(Socket* owner, uint fd) : owner(owner), fd(fd) { }
+
+          // may delete this, so nothing after
+          void reactor_on_readable() {
+            owner->settle(fd);
+          }
+
+          void reactor_on_writable() {
+            owner->settle(fd);
+          }
+      };
+
       std::optional<SSL*> sid;
       std::optional<int> id;
-      addrinfo* ai;
-      bool linked;
+      std::atomic<bool> linked;
+
+      // Connecting runs on the io thread as a series of steps: resolve,
+      // race the addresses, then the tls handshake, each against its own
+      // deadline. Tasks and timers belonging to a connect hold a weak
+      // reference to life, which is dropped when it's torn down, so any
+      // still in flight from an abandoned attempt do nothing.
+      std::atomic<phase> where = phase::IDLE;
+      std::shared_ptr<char> life;
+      std::optional<std::promise<void>> ready;
+
+      std::string host;
+      uint16_t port = 0;
+
+      std::unique_ptr<ptyps::web::net::Eyeballs> race;
+      std::vector<std::unique_ptr<Attempt>> attempts;
+
+      uint64_t deadline = 0;
+      uint64_t stepper = 0;
+      clock::time_point began;
+
+      // whether to ask for kernel tls, and what we ended up with
+      bool kernel = !1;
+      std::atomic<ptyps::web::ssl::offload> route = ptyps::web::ssl::offload::NONE;
+
+      // the io thread this socket lives on, picked on the first connect and
+      // kept from then on
+      ptyps::web::reactor::Loop* home = nullptr;
+      ptyps::web::reactor::Reactor* pool = nullptr;
+
+      // Writes from any thread are queued here and sent by the io thread,
+      // which is the only one that ever touches the SSL*. The io thread
+      // itself writes directly when nothing is waiting in front of it.
+      ptyps::queue::Mpsc<packet> outbound;
+      std::atomic<bool> scheduled = !1;
+      std::atomic<size_t> queued = 0;
+      std::atomic<bool> pressured = !1;
+      size_t mark = 4 * 1024 * 1024;
+      pressure mode = pressure::NOTIFY;
+
+      std::condition_variable drained;
+      std::mutex waiting;
+
+      // reused between flushes so draining doesn't allocate
+      std::vector<packet> batch;
+      std::vector<std::string_view> views;
+
+      // writes tls couldn't take yet, sent before anything else once the
+      // socket is writable again. offset is how much of the first one has
+      // gone already, so nothing is ever erased from the front of a string
+      std::deque<std::string> backlog;
+      size_t offset = 0;
+
+      // reads land here a few tls records at a time, held only while linked
+      std::vector<char> inbox;
+
+      // a read stalled on WANT_WRITE, retry it when writable
+      bool stalled = !1;
+      bool watching = !1;
+
+      void enqueue(packet next) {
+        auto size = next.head.size() + next.body.size();
+
+        outbound.push(std::move(next));
+
+        auto total = queued.fetch_add(size) + size;
+
+        if (!scheduled.exchange(!0)) {
+          home->post([this]() {
+            scheduled = !1;
+            flush();
+          });
+        }
+
+        if (total <= mark || pressured.exchange(!0))
+          return;
+
+        tcp_on_backpressure(!0);
+
+        if (mode != pressure::BLOCK || home->here())
+          return;
+
+        auto lock = std::unique_lock(waiting);
+
+        drained.wait(lock, [&]() {
+          return !pressured || !linked;
+        });
+      }
+
+      void sent(size_t bytes) {
+        auto total = queued.fetch_sub(bytes) - bytes;
+
+        if (pressured && total <= mark / 2)
+          relieve();
+      }
+
+      // keeps whatever of list wasn't sent for when the socket is writable
+      void keep(std::span<const std::string_view> list, size_t skip) {
+        for (auto next : list) {
+          auto drop = std::min(skip, next.size());
+
+          skip -= drop;
+
+          if (next.size() > drop)
+            backlog.emplace_back(next.substr(drop));
+        }
+      }
+
+      // the same, but the batch owns its strings so they can just be moved
+      void keep(std::vector<packet> &list, size_t skip) {
+        for (auto &next : list) {
+          for (auto part : {&next.head, &next.body}) {
+            auto drop = std::min(skip, part->size());
+
+            skip -= drop;
+
+            if (part->size() == drop)
+              continue;
+
+            if (backlog.empty())
+              offset = drop;
+
+            backlog.push_back(std::move(*part));
+          }
+        }
+      }
+
+      // drops done bytes off the front of the backlog
+      void advance(size_t done) {
+        while (done) {
+          auto left = backlog.front().size() - offset;
+
+          if (done < left) {
+            offset += done;
+            return;
+          }
+
+          done -= left;
+          offset = 0;
+          backlog.pop_front();
+        }
+      }
+
+      // Once the kernel does the record layer for sends the views can go
+      // straight to the socket in one gathered write, no staging copy and
+      // no crypto on this thread. Reads keep going through SSL_read, which
+      // with the receive side offloaded is a plain recvmsg that also deals
+      // with the odd non-data record (alerts, tickets, key updates).
+      ptyps::web::ssl::status transmit(std::span<const std::string_view> list, size_t &done) {
+        if (route != ptyps::web::ssl::offload::SEND && route != ptyps::web::ssl::offload::BOTH)
+          return ptyps::web::ssl::send(*sid, list, done);
+
+        auto i = ptyps::web::net::send(*id, list, done);
+
+        if (i == ptyps::web::net::status::WAITING)
+          return ptyps::web::ssl::status::WAITING;
+
+        return i == ptyps::web::net::status::OK ?
+          ptyps::web::ssl::status::OK : ptyps::web::ssl::status::FAIL;
+      }
+
+      // only ask epoll about writability while there's something stuck
+      void watch(bool writable) {
+        if (watching == writable || !id)
+          return;
+
+        watching = writable;
+        home->modify(*id, writable);
+      }
+
+      // sends everything queued so far, as few ssl writes as it takes
+      void flush() {
+        if (!linked)
+          return;
+
+        using pwss = ptyps::web::ssl::status;
+
+        while (backlog.size()) {
+          views.clear();
+
+          for (auto &next : backlog) {
+            if (views.size() == 512)
+              break;
+
+            views.push_back(next);
+          }
+
+          views.front().remove_prefix(offset);
+
+          auto done = size_t(0);
+          auto i = transmit(views, done);
+
+          advance(done);
+          sent(done);
+
+          if (i == pwss::FAIL)
+            return fail();
+
+          if (i == pwss::WAITING)
+            return watch(!0);
+        }
+
+        while (!outbound.empty()) {
+          auto bytes = size_t(0);
+
+          batch.clear();
+          views.clear();
+
+          while (batch.size() < 256) {
+            auto next = outbound.pop();
+
+            if (!next)
+              break;
+
+            bytes += next->head.size() + next->body.size();
+            batch.push_back(std::move(*next));
+          }
+
+          for (auto &next : batch) {
+            views.push_back(next.head);
+            views.push_back(next.body);
+          }
+
+          auto done = size_t(0);
+          auto i = transmit(views, done);
+
+          sent(done);
+
+          if (i == pwss::FAIL)
+            return fail();
+
+          if (i == pwss::WAITING) {
+            keep(batch, done);
+            return watch(!0);
+          }
+        }
+
+        watch(stalled);
+      }
+
+      void relieve() {
+        {
+          auto lock = std::lock_guard(waiting);
+          pressured = !1;
+        }
+
+        drained.notify_all();
+
+        tcp_on_backpressure(!1);
+      }
+
+      // time since the last lap, for the phase timings
+      std::chrono::microseconds lap() {
+        auto now = clock::now();
+        auto out = std::chrono::duration_cast<std::chrono::microseconds>(now - began);
+
+        began = now;
+        return out;
+      }
+
+      // wraps func so it only runs if this connect is still going
+      std::function<void()> guarded(std::function<void()> func) {
+        return [weak = std::weak_ptr(life), func]() {
+          if (!weak.expired())
+            func();
+        };
+      }
+
+      void resolved(ptyps::web::dns::answer found) {
+        times.resolve = lap();
+
+        if (found.empty())
+          return abort("unable to resolve address");
+
+        where = phase::CONNECTING;
+        race = std::make_unique<ptyps::web::net::Eyeballs>(found, port);
+
+        step();
+      }
+
+      // starts the next connect attempt if one's due, and comes back when
+      // the one after that will be
+      void step() {
+        if (race->due()) {
+          auto fd = race->start();
+
+          if (fd && race->winner())
+            return won(*fd);
+
+          if (fd) {
+            attempts.push_back(std::make_unique<Attempt>(this, *fd));
+            home->add(*fd, attempts.back().get(), !0);
+          }
+        }
+
+        if (race->exhausted())
+          return abort("unable to connect socket");
+
+        home->cancel(stepper);
+        stepper = 0;
+
+        if (race->left())
+          stepper = home->after(race->until(), guarded([this]() { step(); }));
+      }
+
+      // one of the racing sockets is writable (or has failed)
+      void settle(uint fd) {
+        home->remove(fd);
+
+        if (race->settle(fd) == ptyps::web::net::status::OK)
+          return won(fd);
+
+        step();
+      }
+
+      void won(uint fd) {
+        // the race has closed the losers already
+        for (auto &next : attempts)
+          home->remove(next->fd);
+
+        attempts.clear();
+        race.reset();
+
+        home->cancel(stepper);
+        home->cancel(deadline);
+        stepper = 0;
+
+        times.connect = lap();
+
+        id = fd;
+        sid = ptyps::web::ssl::open(fd, host, kernel);
+
+        if (!sid)
+          return abort("unable to open ssl");
+
+        where = phase::HANDSHAKING;
+
+        watching = !1;
+        home->add(fd, this);
+
+        deadline = home->after(handshaking, guarded([this]() {
+          abort("tls handshake timed out");
+        }));
+
+        handshake();
+      }
+
+      void handshake() {
+        using pwsp = ptyps::web::ssl::progress;
+
+        auto i = ptyps::web::ssl::handshake(*sid);
+
+        if (i == pwsp::FAIL)
+          return abort("unable to connect ssl socket");
+
+        if (i != pwsp::DONE)
+          return watch(i == pwsp::WRITING);
+
+        home->cancel(deadline);
+        deadline = 0;
+
+        times.handshake = lap();
+        route = ptyps::web::ssl::offloaded(*sid);
+
+        inbox.resize(ptyps::web::ssl::RECORD * 4);
+        watch(!1);
+
+        where = phase::OPEN;
+        linked = !0;
+
+        auto done = std::move(ready);
+        ready.reset();
+
+        tcp_on_connect();
+        flush();
+
+        if (done)
+          done->set_value();
+      }
+
+      // lets go of everything a connection (or a connect) holds
+      void teardown() {
+        life.reset();
+
+        home->cancel(deadline);
+        home->cancel(stepper);
+        deadline = 0;
+        stepper = 0;
+
+        for (auto &next : attempts)
+          home->remove(next->fd);
+
+        attempts.clear();
+        race.reset();
+
+        if (id)
+          home->remove(*id);
+
+        if (sid)
+          ptyps::web::ssl::close(*sid);
+
+        if (id)
+          ptyps::web::net::close(*id);
+
+        sid.reset();
+        id.reset();
+        route = ptyps::web::ssl::offload::NONE;
+
+        while (outbound.pop());
+        backlog.clear();
+        offset = 0;
+        inbox = std::vector<char>();
+        queued = 0;
+      }
+
+      // gives up on a connect that hasn't finished
+      void abort(std::string why) {
+        teardown();
+        where = phase::IDLE;
+
+        auto done = std::move(ready);
+        ready.reset();
+
+        tcp_on_fail(why);
+
+        if (done)
+          done->set_exception(std::make_exception_ptr(exception(why)));
+      }
+
+      // tears the connection down, on the io thread
+      void fail() {
+        if (where == phase::IDLE)
+          return;
+
+        if (where != phase::OPEN)
+          return abort("disconnected while connecting");
+
+        linked = !1;
+
+        teardown();
+        where = phase::IDLE;
+
+        if (pressured)
+          relieve();
+
+        tcp_on_disconnect();
+      }
+
+      bool on_io_thread() {
+        return home && home->here() && outbound.empty() && backlog.empty();
+      }
+
+      // writes straight from the io thread, holding on to whatever tls
+      // can't take right now
+      void direct(std::span<const std::string_view> list) {
+        auto done = size_t(0);
+        auto i = transmit(list, done);
+
+        if (i == ptyps::web::ssl::status::FAIL)
+          return fail();
+
+        if (i == ptyps::web::ssl::status::WAITING) {
+          auto total = size_t(0);
+
+          for (auto next : list)
+            total += next.size();
+
+          keep(list, done);
+          queued += total - done;
+
+          watch(!0);
+        }
+      }
+
+    protected:
+      timings times;
 
     public:
-      virtual void tcp_on_recvd(std::string recvd) {
+      // recvd is only good for the duration of the call
+      virtual void tcp_on_recvd(std::string_view recvd) {
 
       }
 
@@ -31,97 +565,231 @@ namespace ptyps::web::tcps {
 
       }
 
+      // a connect didn't make it, why says which phase gave up
+      virtual void tcp_on_fail(std::string_view why) {
+
+      }
+
+      // true once more than the high water mark is queued, false again
+      // once it's half drained; called from whichever thread crossed it
+      virtual void tcp_on_backpressure(bool pressured) {
+
+      }
+
+      // -----
+
+      // reads until tls has nothing more for us
+      void reactor_on_readable() {
+        using pwse = ptyps::web::ssl::event;
+
+        if (where == phase::HANDSHAKING)
+          return handshake();
+
+        stalled = !1;
+
+        while (linked) {
+          auto vari = ptyps::web::ssl::recv(*sid, inbox);
+
+          if (std::holds_alternative<pwse>(vari)) {
+            auto event = std::get<pwse>(vari);
+
+            if (event == pwse::WAITING)
+              break;
+
+            if (event == pwse::STALLED) {
+              stalled = !0;
+              watch(!0);
+              break;
+            }
+
+            return fail();
+          }
+
+          tcp_on_recvd(std::get<std::string_view>(vari));
+        }
+      }
+
+      void reactor_on_writable() {
+        if (where == phase::HANDSHAKING)
+          return handshake();
+
+        if (stalled)
+          reactor_on_readable();
+
+        flush();
+      }
+
       // -----
 
+      // deadlines for resolving plus connecting, and for the tls handshake
+      std::chrono::milliseconds connecting = std::chrono::seconds(10);
+      std::chrono::milliseconds handshaking = std::chrono::seconds(10);
+
       Socket() {
-        ai = new addrinfo();
         linked = !1;
+      }
 
-        ptyps::web::net::set_type(ai, ptyps::web::net::type::STREAM);
-        ptyps::web::net::set_proto(ai, ptyps::web::net::proto::TCP);
+      // the most derived class should disconnect() in its own destructor,
+      // otherwise a callback could still be running on the io thread while
+      // the parts it uses are being torn down
+      virtual ~Socket() {
+        disconnect();
       }
 
       bool connected() {
         return linked;
       }
 
+      // asks for kernel tls on the next connect; if the kernel module or the
+      // negotiated cipher isn't up to it, tls just stays in user space
+      void offload(bool enabled) {
+        kernel = enabled;
+      }
+
+      // which directions the kernel is doing tls for on this connection
+      ptyps::web::ssl::offload offloaded() {
+        return route;
+      }
+
+      // whether the tls handshake got to skip the full exchange
+      bool resumed() {
+        return sid && ptyps::web::ssl::resumed(*sid);
+      }
+
       void write(std::string text) {
+        write({}, std::move(text));
+      }
+
+      void write(std::string head, std::string body) {
         if (!linked)
           throw exception("cannot write to closed socket");
 
-        ptyps::web::ssl::send(*sid, text);
+        if (!on_io_thread())
+          return enqueue({std::move(head), std::move(body)});
+
+        std::string_view list[] = {head, body};
+
+        direct(list);
       }
 
-      void connect(uint16_t port, std::string addr) {
-        auto lookup = ptyps::web::net::lookup(addr);
+      // views are only copied if the write has to be queued
+      void write(std::span<const std::string_view> list) {
+        if (!linked)
+          throw exception("cannot write to closed socket");
 
-        if (!lookup.size())
-          throw exception("unable to resolve address");
+        if (on_io_thread())
+          return direct(list);
 
-        ptyps::web::net::set_addr(ai, lookup.at(0));
-        ptyps::web::net::set_port(ai, port);
+        auto body = std::string();
 
-        id = ptyps::web::net::open(ai);
+        for (auto next : list)
+          body.append(next);
 
-        if (!id)
-          throw exception("unable to open socket");
+        enqueue({{}, std::move(body)});
+      }
 
-        auto i = ptyps::web::net::connect(*id, ai);
+      // drops the connection, tcp_on_disconnect is called from the io thread
+      // and has finished by the time this returns
+      void disconnect() {
+        if (home)
+          home->run_sync([this]() { fail(); });
+      }
 
-        if (i == ptyps::web::net::status::FAIL)
-          throw exception("unable to connect socket");
+      // io threads to connect on instead of the shared reactor, which have
+      // to outlive the socket; before the first connect, as that's when the
+      // socket picks the io thread it stays on
+      void attach(ptyps::web::reactor::Reactor &threads) {
+        if (home)
+          throw exception("socket already has an io thread");
 
-        sid = ptyps::web::ssl::open(*id);
+        pool = &threads;
+      }
 
-        if (!sid)
-          throw exception("unable to open ssl");
+      // bytes waiting to be sent
+      size_t pending() {
+        return queued;
+      }
 
-        auto s = ptyps::web::ssl::connect(*sid);
+      void highwater(size_t bytes, pressure when = pressure::NOTIFY) {
+        mark = bytes;
+        mode = when;
+      }
 
-        if (s == ptyps::web::ssl::status::FAIL)
-          throw exception("unable to connect ssl socket");
+      // timers on this socket's io thread, see reactor::Loop
+      template <typename T, typename D>
+        uint64_t every(std::chrono::duration<T, D> time, std::function<bool()> func) {
+          if (!home)
+            throw exception("socket has no io thread yet");
 
-        // set the socket as non-blocking
-        fcntl(*id, F_SETFL, O_NONBLOCK);
+          return home->every(time, func);
+        }
 
-        linked = !0;
+      template <typename T, typename D>
+        uint64_t after(std::chrono::duration<T, D> wait, std::function<void()> func) {
+          if (!home)
+            throw exception("socket has no io thread yet");
 
-        tcp_on_connect();
+          return home->after(wait, func);
+        }
 
-        using pwse = ptyps::web::ssl::event;
+      void cancel(uint64_t timer) {
+        if (home && timer)
+          home->cancel(timer);
+      }
 
-        ptyps::thread::loop_run([&]() -> bool {
-          if (!linked)
-            return !1;
+      // Starts connecting and returns straight away. The future is ready
+      // once the handshake is done (tcp_on_connect has been called by then)
+      // and throws if any phase fails or runs out of time.
+      std::future<void> connect(uint16_t port, std::string addr) {
+        auto expected = phase::IDLE;
 
-          auto vari = ptyps::web::ssl::recv(*sid);
+        if (!where.compare_exchange_strong(expected, phase::RESOLVING))
+          throw exception("socket is already connected");
 
-          if (std::holds_alternative<pwse>(vari)) {
-            auto event = std::get<pwse>(vari);
+        // once, so reconnecting never moves it while other threads post to it
+        if (!home)
+          home = &(pool ? *pool : ptyps::web::reactor::shared()).pick();
 
-            if (event == pwse::DISCONNECTED || event == pwse::ERROR) {
-              linked = !1;
-              tcp_on_disconnect();
-              return !0;
-            }
+        this->host = addr;
+        this->port = port;
 
-            if (event == pwse::WAITING)
-              return !1;
-          }
+        times = {};
+        began = clock::now();
 
-          auto recvd = std::get<std::string>(vari);
+        life = std::make_shared<char>();
+        ready = std::promise<void>();
 
-          tcp_on_recvd(recvd);
+        auto out = ready->get_future();
+        auto loop = home;
 
-          return !1;
+        deadline = home->after(connecting, guarded([this]() {
+          abort("connect timed out");
+        }));
+
+        ptyps::web::dns::shared().resolve(addr, [this, loop, weak = std::weak_ptr(life)](auto found) {
+          loop->run_here([this, weak, found]() {
+            if (!weak.expired())
+              resolved(found);
+          });
         });
+
+        return out;
+      }
+
+      phase stage() {
+        return where;
       }
-  
+
+      // how long the phases of the last connect took
+      timings timing() {
+        return times;
+      }
+
       // waits until the connection is disconnected
       void loop(uint seconds = 1) {
         auto timeout = std::chrono::seconds(seconds);
 
-        while (linked)
+        while (where != phase::IDLE)
           ptyps::time::wait(timeout);
       }
   };
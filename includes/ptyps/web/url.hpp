@@ -78,7 +78,7 @@ namespace ptyps::web::url {
   parsed parse(std::string addr) {
     auto map = std::map<std::string, std::string>();
 
-    auto protocol = addr.substr(0, addr.find_first_of("://"));
+    auto protocol = addr.substr(0, addr.find("://"));
 
     addr = addr.substr(protocol.length() + 3);
 
@@ -92,8 +92,8 @@ namespace ptyps::web::url {
     auto port = uint16_t();
 
     if (i != EOF) {
-      port = std::stoi(host.substr(0, i++));
-      host = host.substr(i);
+      port = std::stoi(host.substr(i + 1));
+      host = host.substr(0, i);
     }
 
     else {
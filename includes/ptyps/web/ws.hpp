@@ -3,10 +3,23 @@
 // Copyright (C) 2022 Dave Perry (dbdii407)
 
 #include "../crypto.hpp"
+#include "../metrics.hpp"
 #include "../random.hpp"
+#include "../zlib.hpp"
+#include "./http.hpp"
 #include "./tcp.hpp"
 #include "./url.hpp"
 
+#include <charconv>
+#include <atomic>
+#include <cstring>
+#include <array>
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace ptyps::web::ws {
   using exception = ptyps::err::exception;
 
@@ -28,6 +41,8 @@ namespace ptyps::web::ws {
 
   constexpr int MASK = 0b10000000;
   constexpr int FIN = 0b10000000;
+  constexpr int RSV1 = 0b01000000;
+  constexpr int RSV = 0b01110000;
   constexpr int MASKLEN = 4;
 
   enum class opcode {
@@ -85,194 +100,712 @@ namespace ptyps::web::ws {
 
   static std::string magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+  // 16 random bytes, base64'd
   std::string createHandshakeKey() {
-    auto random = ptyps::random::string(12, std::vector<char>({
-      'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J',
-      'K', 'L', 'M', 'N', 'O', 'P', 'Q', 'R', 'S', 'T',
-      'U', 'V', 'W', 'X', 'Y', 'Z',
-      'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
-      'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't',
-      'u', 'v', 'w', 'x', 'y', 'z',
-      '0', '1', '2', '3', '4', '5', '6', '7', '8', '9'
-    }));
-
-    auto hash = ptyps::crypto::sha1(random + magic);
+    auto random = std::string(16, '\0');
+
+    for (auto i = 0; i < 16; i += 4) {
+      auto next = ptyps::random::word();
+      std::memcpy(&random[i], &next, 4);
+    }
+
+    return ptyps::crypto::base64(random);
+  }
+
+  // what the server has to answer a handshake key with
+  std::string createAcceptKey(std::string_view key) {
+    auto hash = ptyps::crypto::sha1_digest(std::string(key) + magic);
 
     return ptyps::crypto::base64(hash);
   }
 
-  std::vector<uint8_t> createMaskingKey() {
-    auto out = std::vector<uint8_t>();
+  using masking_key = std::array<uint8_t, MASKLEN>;
 
-    for (auto i = 0; i < MASKLEN; i++) {
-      auto next = ptyps::random::number(0, 255);
-      out.push_back(next);
-    }
+  masking_key createMaskingKey() {
+    auto out = masking_key();
+    auto next = ptyps::random::word();
+
+    std::memcpy(out.data(), &next, MASKLEN);
 
     return out;
   }
 
-  std::vector<uint8_t> UInt64ToUInt8(ulong i) {
-    auto vect = std::vector<uint8_t>();
+  // -----
+
+  // Masks (or unmasks) data in place. The key is widened to fill a 64 bit
+  // word or an SSE2/AVX2 register; every block is a multiple of 4 bytes so
+  // the key stays in phase, and whatever's left is done a byte at a time.
 
-    vect.push_back((i >> 56) & 0xFF);
-    vect.push_back((i >> 48) & 0xFF);
-    vect.push_back((i >> 40) & 0xFF);
-    vect.push_back((i >> 32) & 0xFF);
-    vect.push_back((i >> 24) & 0xFF);
-    vect.push_back((i >> 16) & 0xFF);
-    vect.push_back((i >>  8) & 0xFF);
-    vect.push_back((i >>  0) & 0xFF);
+#if defined(__x86_64__)
+  __attribute__((target("avx2")))
+  size_t mask_avx2(char* data, size_t length, uint32_t key) {
+    auto wide = _mm256_set1_epi32(key);
+    auto i = size_t(0);
 
-    return vect;
+    for (; i + 32 <= length; i += 32) {
+      auto next = _mm256_loadu_si256((__m256i *) (data + i));
+      _mm256_storeu_si256((__m256i *) (data + i), _mm256_xor_si256(next, wide));
+    }
+
+    return i;
   }
 
-  std::vector<uint8_t> UInt16ToUInt8(ulong i) {
-    auto vect = std::vector<uint8_t>();
+  size_t mask_sse2(char* data, size_t length, uint32_t key) {
+    auto wide = _mm_set1_epi32(key);
+    auto i = size_t(0);
 
-    vect.push_back((i >> 8) & 0xFF);
-    vect.push_back((i >> 0) & 0xFF);
+    for (; i + 16 <= length; i += 16) {
+      auto next = _mm_loadu_si128((__m128i *) (data + i));
+      _mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(next, wide));
+    }
 
-    return vect;
+    return i;
   }
 
-  std::string encode(bool masked, opcode op, std::string data) {
-    auto vect = std::vector<uint8_t>();
-    auto length = data.size();
-    auto p = 0;
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  void mask(char* data, size_t length, const masking_key &key) {
+    auto word = uint32_t();
+    auto i = size_t(0);
+
+    std::memcpy(&word, key.data(), MASKLEN);
+
+#if defined(__x86_64__)
+    if (has_avx2)
+      i = mask_avx2(data, length, word);
+
+    i += mask_sse2(data + i, length - i, word);
+#endif
+
+    auto wide = ((uint64_t) word << 32) | word;
+
+    for (; i + 8 <= length; i += 8) {
+      auto next = uint64_t();
 
-    auto size = (length >= 65536 ? 6 : 0) + (length >= 126 ? 2 : 0) +
-                (masked ? MASKLEN : 0) + 2;
+      std::memcpy(&next, data + i, 8);
+      next ^= wide;
+      std::memcpy(data + i, &next, 8);
+    }
+
+    for (; i < length; i++)
+      data[i] ^= key[i & 0x03];
+  }
 
-    vect.resize(size);
+  void UInt64ToUInt8(uint64_t i, uint8_t* out) {
+    out[0] = (i >> 56) & 0xFF;
+    out[1] = (i >> 48) & 0xFF;
+    out[2] = (i >> 40) & 0xFF;
+    out[3] = (i >> 32) & 0xFF;
+    out[4] = (i >> 24) & 0xFF;
+    out[5] = (i >> 16) & 0xFF;
+    out[6] = (i >>  8) & 0xFF;
+    out[7] = (i >>  0) & 0xFF;
+  }
+
+  void UInt16ToUInt8(uint16_t i, uint8_t* out) {
+    out[0] = (i >> 8) & 0xFF;
+    out[1] = (i >> 0) & 0xFF;
+  }
 
-    vect[p++] = FIN + std::underlying_type_t<opcode>(op);
+  // -----
+
+  constexpr int MAXHEADER = 14; // 2 + 8 (length) + 4 (mask)
+
+  using header_buffer = std::array<char, MAXHEADER>;
+
+  // writes a frame header into out, returns how many bytes of it were used
+  // compressed sets RSV1, for the first frame of a permessage-deflate message
+  size_t encode_header(header_buffer &out, opcode op, uint64_t length, std::optional<masking_key> key = {}, bool fin = !0, bool compressed = !1) {
+    auto bytes = (uint8_t *) out.data();
+    auto p = 0;
+
+    bytes[p++] = (fin ? FIN : 0) | (compressed ? RSV1 : 0) | std::underlying_type_t<opcode>(op);
+
+    auto masked = key ? MASK : 0;
 
     if (length <= 125)
-      vect[p++] = (char(length) & 0xFF) | (masked ? MASK : 0);
+      bytes[p++] = length | masked;
 
-    else if (length >= 126 && length <= 65565) {
-      vect[p++] = char(0x7E) | (masked ? MASK : 0);
+    else if (length <= 65535) {
+      bytes[p++] = 0x7E | masked;
 
-      for (auto i : UInt16ToUInt8(length))
-        vect[p++] = i;
+      UInt16ToUInt8(length, bytes + p);
+      p += 2;
     }
 
     else {
-      vect[p++] = char(0x7F) | (masked ? MASK : 0);
+      bytes[p++] = 0x7F | masked;
 
-      for (auto i : UInt64ToUInt8(length))
-        vect[p++] = i;
+      UInt64ToUInt8(length, bytes + p);
+      p += 8;
     }
 
+    if (key) {
+      std::memcpy(bytes + p, key->data(), MASKLEN);
+      p += MASKLEN;
+    }
+
+    return p;
+  }
+
+  std::string encode(bool masked, opcode op, std::string_view data, bool compressed = !1) {
+    auto head = header_buffer();
     auto key = createMaskingKey();
 
-    if (masked) {
-      vect[p++] = key[0];
-      vect[p++] = key[1];
-      vect[p++] = key[2];
-      vect[p++] = key[3];
+    auto size = encode_header(head, op, data.size(), masked ? std::optional(key) : std::nullopt, !0, compressed);
+
+    auto out = std::string();
+
+    out.reserve(size + data.size());
+    out.append(head.data(), size);
+    out.append(data);
+
+    if (masked)
+      mask(out.data() + size, data.size(), key);
+
+    return out;
+  }
+
+  uint16_t UInt16FromUInt8(const uint8_t* data) {
+    return ((uint16_t) data[0] << 8) |
+           ((uint16_t) data[1] << 0);
+  }
+
+  uint64_t UInt64FromUInt8(const uint8_t* data) {
+    return ((uint64_t) data[0] << 56) |
+           ((uint64_t) data[1] << 48) |
+           ((uint64_t) data[2] << 40) |
+           ((uint64_t) data[3] << 32) |
+           ((uint64_t) data[4] << 24) |
+           ((uint64_t) data[5] << 16) |
+           ((uint64_t) data[6] <<  8) |
+           ((uint64_t) data[7] <<  0);
+  }
+
+  // -----
+
+  struct header {
+    public:
+      bool fin;
+      uint8_t rsv; // RSV1 to RSV3, as they are in the first byte
+      uint8_t opcode;
+      bool masked;
+      uint64_t length;
+      masking_key key;
+      size_t size; // header size in bytes
+  };
+
+  // reads a frame header off the front of data, empty if it isn't all there yet
+  std::optional<header> read_header(std::string_view data) {
+    if (data.size() < 2)
+      return {};
+
+    auto bytes = (const uint8_t *) data.data();
+    auto out = header();
+
+    out.fin = (bytes[0] & FIN) == FIN;
+    out.rsv = bytes[0] & RSV;
+    out.opcode = bytes[0] & 0x0F;
+    out.masked = (bytes[1] & MASK) == MASK;
+    out.length = bytes[1] & 0x7F;
+    out.size = 2;
+
+    if (out.length == 126) {
+      if (data.size() < 4)
+        return {};
+
+      out.length = UInt16FromUInt8(bytes + 2);
+      out.size = 4;
     }
 
-    ptyps::funcs::append(vect, data);
+    else if (out.length == 127) {
+      if (data.size() < 10)
+        return {};
 
-    if (masked) {
-      for (auto i = 0; i != length; ++i)
-        vect[size + i] ^= key[i & 0x03];
+      out.length = UInt64FromUInt8(bytes + 2);
+      out.size = 10;
     }
 
-    return ptyps::funcs::to<std::basic_string, char>(vect);
-  }
+    if (out.masked) {
+      if (data.size() < out.size + MASKLEN)
+        return {};
+
+      std::memcpy(out.key.data(), bytes + out.size, MASKLEN);
+      out.size += MASKLEN;
+    }
 
-  uint16_t UInt16FromUInt8(std::vector<uint8_t> &vect, int &pos) {
-    return ((uint16_t) vect[pos++] << 8) |
-           ((uint16_t) vect[pos++] << 0);
+    return out;
   }
 
-  uint64_t UInt64FromUInt8(std::vector<uint8_t> &vect, int &pos) {
-    return ((uint64_t) vect[pos++] << 56) |
-           ((uint64_t) vect[pos++] << 48) |
-           ((uint64_t) vect[pos++] << 40) |
-           ((uint64_t) vect[pos++] << 32) |
-           ((uint64_t) vect[pos++] << 24) |
-           ((uint64_t) vect[pos++] << 16) |
-           ((uint64_t) vect[pos++] <<  8) |
-           ((uint64_t) vect[pos++] <<  0);
+  // -----
+
+  // permessage-deflate (RFC 7692). A message is raw deflate, flushed and
+  // sent without the 00 00 FF FF the flush ends on, with RSV1 set on its
+  // first frame. Either side can carry its context over from one message
+  // to the next (context takeover) and can be held to a smaller window.
+
+  constexpr auto PERMESSAGE_DEFLATE = "permessage-deflate";
+
+  // inbound messages are inflated with the biggest window, which takes
+  // anything a smaller one made
+  constexpr int INFLATE_WINDOW = -15;
+
+  // what's offered in the upgrade request
+  struct deflate_settings {
+    public:
+      bool enabled = !1;
+
+      // asks the server to start every message afresh, which lets our
+      // inflate context go back to the pool between messages
+      bool server_no_context_takeover = !1;
+
+      // does the same with ours, and says so
+      bool client_no_context_takeover = !1;
+
+      // 8 to 15, 15 is the default and isn't sent
+      int server_max_window_bits = 15;
+      int client_max_window_bits = 15;
+
+      // outbound messages at least this big are compressed, 0 for none
+      size_t threshold = 1024;
+      int level = Z_DEFAULT_COMPRESSION;
+  };
+
+  // what the server agreed to
+  struct deflate_params {
+    public:
+      bool server_no_context_takeover = !1;
+      bool client_no_context_takeover = !1;
+      int server_max_window_bits = 15;
+      int client_max_window_bits = 15;
+  };
+
+  // the Sec-WebSocket-Extensions value for settings
+  std::string offer(const deflate_settings &settings) {
+    auto out = std::string(PERMESSAGE_DEFLATE);
+
+    if (settings.server_no_context_takeover)
+      out += "; server_no_context_takeover";
+
+    if (settings.client_no_context_takeover)
+      out += "; client_no_context_takeover";
+
+    if (settings.server_max_window_bits < 15)
+      out += "; server_max_window_bits=" + std::to_string(settings.server_max_window_bits);
+
+    // sent bare otherwise, so the server knows it can ask for less
+    if (settings.client_max_window_bits < 15)
+      out += "; client_max_window_bits=" + std::to_string(settings.client_max_window_bits);
+
+    else
+      out += "; client_max_window_bits";
+
+    return out;
   }
 
-  using decode_variant = std::variant<std::monostate, std::string, status>;
-  using decode_callback = std::function<void(opcode, decode_variant)>;
+  // reads the server's Sec-WebSocket-Extensions; empty if it isn't what
+  // was offered, which fails the connection
+  std::optional<deflate_params> agree(std::string_view header, const deflate_settings &offered) {
+    auto out = deflate_params();
+
+    // only the one extension was offered
+    if (header.find(',') != std::string_view::npos)
+      return {};
+
+    auto first = !0;
+    auto seen = std::vector<std::string_view>();
 
-  void decode(std::string recvd, std::string &rxbuf, decode_callback func) {
-    if (rxbuf.length())
-      recvd = rxbuf + recvd;
-    
-    rxbuf.clear();
+    auto bits = [](std::string_view value) -> std::optional<int> {
+      if (value.size() > 1 && value.front() == '"' && value.back() == '"')
+        value = value.substr(1, value.size() - 2);
 
-    auto vect = ptyps::funcs::to<std::vector, uint8_t>(recvd);
+      auto out = 0;
+      auto [end, err] = std::from_chars(value.data(), value.data() + value.size(), out);
+
+      if (err != std::errc() || end != value.data() + value.size() || out < 8 || out > 15)
+        return {};
+
+      return out;
+    };
 
     while (!0) {
-      if (vect.size() < 2) {
-        ptyps::funcs::append(rxbuf, vect);
-        break;
+      auto semi = header.find(';');
+      auto part = ptyps::web::http::trim(header.substr(0, semi));
+
+      if (first) {
+        if (!ptyps::web::http::same(part, PERMESSAGE_DEFLATE))
+          return {};
+
+        first = !1;
       }
 
-      // auto fin = (vect[0] & FIN) == FIN; // if 1, last message in series
-      auto msk = (vect[1] & MASK) == MASK; // if masked
+      else {
+        auto equals = part.find('=');
+        auto name = ptyps::web::http::trim(part.substr(0, equals));
+        auto value = equals == std::string_view::npos ? std::string_view() : ptyps::web::http::trim(part.substr(equals + 1));
+
+        if (std::find(seen.begin(), seen.end(), name) != seen.end())
+          return {};
 
-      auto opc = vect[0] & 0x0F; // opcode
-      auto len = vect[1] & 0x7F; // content length
+        seen.push_back(name);
 
-      auto pos = 2;
+        if (name == "server_no_context_takeover" && value.empty())
+          out.server_no_context_takeover = !0;
 
-      if (len == 126)
-        len = UInt16FromUInt8(vect, pos);
+        else if (name == "client_no_context_takeover" && value.empty())
+          out.client_no_context_takeover = !0;
 
-      if (len == 127)
-        len = UInt64FromUInt8(vect, pos);
+        else if (name == "server_max_window_bits") {
+          auto found = bits(value);
 
-      auto size = (msk ? MASKLEN : 0) + (len >= 65536 ? 6 : 0) + // frame header size
-                  (len >= 126 ? 2 : 0) + 2;
+          if (!found || *found > offered.server_max_window_bits)
+            return {};
+
+          out.server_max_window_bits = *found;
+        }
 
-      auto total = size + len; // total length of the frame
+        else if (name == "client_max_window_bits") {
+          auto found = bits(value);
 
-      if (vect.size() < total) {
-        ptyps::funcs::append(rxbuf, vect);
+          if (!found)
+            return {};
+
+          out.client_max_window_bits = *found;
+        }
+
+        else
+          return {};
+      }
+
+      if (semi == std::string_view::npos)
         break;
+
+      header.remove_prefix(semi + 1);
+    }
+
+    // what we asked of ourselves holds whether or not it's repeated back
+    out.client_no_context_takeover |= offered.client_no_context_takeover;
+    out.client_max_window_bits = std::min(out.client_max_window_bits, offered.client_max_window_bits);
+
+    return out;
+  }
+
+  // -----
+
+  using decode_variant = std::variant<std::monostate, std::string_view, status>;
+
+  // fin is only ever false in streaming mode, for all but the last piece
+  // of a fragmented message
+  using decode_callback = std::function<void(opcode, decode_variant, bool fin)>;
+
+  // Incremental frame decoder. Whole frames are parsed straight out of the
+  // bytes handed to feed() and their payloads are passed on as views, only
+  // a trailing partial frame gets copied into the decoder's own buffer. The
+  // views are valid for the duration of the callback only.
+  //
+  // Fragmented messages are put back together before being handed on,
+  // unless stream is set, in which case each fragment is passed along as
+  // it arrives. Messages larger than max (if set) fail the decoder with
+  // MSG_TOO_BIG as soon as the header that pushes them over is seen.
+  //
+  // Once deflate is set, messages with RSV1 are inflated frame by frame as
+  // they come in, compressed fragments are never put back together. max
+  // holds for what they inflate to as well.
+  //
+  // A callback that drops the connection has to halt() the decoder, as
+  // what's left of the read it was fed may go with the connection.
+
+  class Decoder {
+    private:
+      std::vector<char> buffer;
+      size_t head = 0;
+      size_t tail = 0;
+
+      // scratch space for masked payloads, which can't be unmasked in place
+      std::string unmasked;
+
+      // the message currently being put together from fragments
+      std::optional<uint8_t> fragmented;
+      std::string message;
+      size_t received = 0;
+
+      std::optional<status> error;
+      bool halted = !1;
+
+      // permessage-deflate; the inflater is only held between messages
+      // while the peer carries its context over
+      std::unique_ptr<ptyps::zlib::Inflater> inflater;
+      bool inflating = !1;
+
+      std::string_view pending() {
+        return std::string_view(buffer.data() + head, tail - head);
       }
 
-      auto key = std::vector<int>();
+      // copies data onto the end of the buffer, compacting before growing
+      void store(std::string_view data) {
+        if (data.empty())
+          return;
 
-      if (msk) {
-        for (auto i = 0; i < MASKLEN; i++)
-          key[i] = ((int) vect[size + i]) << 0;
+        if (buffer.size() - tail < data.size() && head) {
+          std::memmove(buffer.data(), buffer.data() + head, tail - head);
+          tail -= head;
+          head = 0;
+        }
+
+        if (buffer.size() - tail < data.size())
+          buffer.resize(std::max(buffer.size() * 2, tail + data.size()));
+
+        std::memcpy(buffer.data() + tail, data.data(), data.size());
+        tail += data.size();
       }
 
-      // -----
+      // checks a frame header before any of its payload is buffered
+      bool admit(header &frame) {
+        auto control = (frame.opcode & 0x08) == 0x08;
+
+        // RSV1 only means anything on the first frame of a deflated message
+        if ((frame.rsv & ~RSV1) || (frame.rsv && (!deflate || control || frame.opcode == OPCODE_CONTINUATION)))
+          error = status::PROTO_ERROR;
+
+        else if (control && (!frame.fin || frame.length > 125))
+          error = status::PROTO_ERROR;
 
-      if (opc == OPCODE_PING) {
-        printf("ping len: %i\r\n", len);
+        else if (frame.opcode == OPCODE_CONTINUATION && !fragmented)
+          error = status::PROTO_ERROR;
+
+        else if ((frame.opcode == OPCODE_TEXT || frame.opcode == OPCODE_BINARY) && fragmented)
+          error = status::PROTO_ERROR;
+
+        else if (!control && max && received + frame.length > max)
+          error = status::MSG_TOO_BIG;
+
+        return !error;
       }
 
-      if (opc == OPCODE_CLOSE) {
-        auto code = UInt16FromUInt8(vect, pos);
-        auto status = static_cast<enum status>(code);
+      void dispatch(header &frame, std::string_view payload, decode_callback &func) {
+        if (frame.masked) {
+          unmasked.assign(payload);
+          mask(unmasked.data(), unmasked.size(), frame.key);
+
+          payload = unmasked;
+        }
+
+        if (frame.opcode == OPCODE_PING)
+          func(opcode::PING, payload, !0);
+
+        if (frame.opcode == OPCODE_PONG)
+          func(opcode::PONG, payload, !0);
+
+        if (frame.opcode == OPCODE_CLOSE) {
+          auto code = STATUS_NO_STATUS;
+
+          if (payload.size() >= 2)
+            code = UInt16FromUInt8((const uint8_t *) payload.data());
+
+          func(opcode::CLOSE, static_cast<status>(code), !0);
+        }
+
+        if (frame.opcode == OPCODE_TEXT || frame.opcode == OPCODE_BINARY) {
+          auto op = static_cast<opcode>(frame.opcode);
+
+          inflating = frame.rsv;
+
+          if (inflating) {
+            auto found = inflate(payload, !0, frame.fin);
+
+            if (!found)
+              return;
+
+            payload = *found;
+          }
+
+          if (frame.fin) {
+            func(op, payload, !0);
+            return settle();
+          }
+
+          fragmented = frame.opcode;
+          received = frame.length;
+
+          if (stream)
+            return func(op, payload, !1);
+
+          // the inflater has it already
+          if (!inflating)
+            message.assign(payload);
+        }
+
+        if (frame.opcode == OPCODE_CONTINUATION) {
+          auto op = static_cast<opcode>(*fragmented);
+
+          received += payload.size();
+
+          if (inflating) {
+            auto found = inflate(payload, !1, frame.fin);
+
+            if (!found)
+              return;
+
+            payload = *found;
+          }
 
-        func(opcode::CLOSE, status);
+          if (stream)
+            func(op, payload, frame.fin);
+
+          else if (inflating) {
+            if (frame.fin)
+              func(op, inflater->data(), !0);
+          }
+
+          else {
+            message.append(payload);
+
+            if (frame.fin)
+              func(op, std::string_view(message), !0);
+          }
+
+          if (frame.fin) {
+            fragmented.reset();
+            message.clear();
+            received = 0;
+
+            settle();
+          }
+        }
       }
 
-      if (opc == OPCODE_TEXT || opc == OPCODE_BINARY || opc == OPCODE_CONTINUATION) {
-        auto begin = ptyps::iter::begin(vect, size);
-        auto end = ptyps::iter::begin(vect, total);
+      // inflates the next frame of a deflated message, giving back what
+      // came out of it; empty if the decoder failed
+      std::optional<std::string_view> inflate(std::string_view payload, bool first, bool fin) {
+        if (!inflater)
+          inflater = ptyps::zlib::inflaters.take(INFLATE_WINDOW);
+
+        auto before = first ? 0 : inflater->data().size();
+        auto suffix = std::string_view(ptyps::zlib::SUFFIX, sizeof(ptyps::zlib::SUFFIX));
+
+        // inflating stops as soon as the message is past max, however much
+        // more the frame would have come to
+        auto good = inflater->append(payload, max) && (!fin || inflater->append(suffix, max));
+
+        if (!good) {
+          error = inflater->oversized() ? status::MSG_TOO_BIG : status::INVALID_PAYLOAD;
+          return {};
+        }
+
+        if (fin)
+          inflater->finish();
+
+        return inflater->data().substr(before);
+      }
 
-        auto data = std::string(begin, end);
+      // a message is done with; without context takeover the next one
+      // starts afresh, so the inflater can go back until then
+      void settle() {
+        if (inflating && !takeover)
+          ptyps::zlib::inflaters.give(std::move(inflater), INFLATE_WINDOW);
 
-        func(opcode::TEXT, data);
+        inflating = !1;
       }
 
-      ptyps::funcs::chop(vect, total);
-    }
-  }
+      // decodes every whole frame at the front of data, returns bytes used
+      size_t parse(std::string_view data, decode_callback &func) {
+        auto pos = size_t(0);
+
+        while (!error && !halted) {
+          auto rest = data.substr(pos);
+          auto frame = read_header(rest);
+
+          if (!frame || !admit(*frame) || rest.size() - frame->size < frame->length)
+            break;
+
+          dispatch(*frame, rest.substr(frame->size, frame->length), func);
+
+          pos += frame->size + frame->length;
+        }
+
+        return pos;
+      }
+
+    public:
+      size_t max = 0;
+      bool stream = !1;
+
+      // set once permessage-deflate is agreed on; takeover is whether the
+      // peer carries its context over from one message to the next
+      bool deflate = !1;
+      bool takeover = !0;
+
+      Decoder() = default;
+      Decoder(const Decoder &) = delete;
+
+      ~Decoder() {
+        ptyps::zlib::inflaters.give(std::move(inflater), INFLATE_WINDOW);
+      }
+
+      // for a new connection, forgets whatever was left of the last one
+      void reset() {
+        head = tail = 0;
+        fragmented.reset();
+        message.clear();
+        received = 0;
+        error.reset();
+        halted = !1;
+
+        ptyps::zlib::inflaters.give(std::move(inflater), INFLATE_WINDOW);
+        inflating = !1;
+        deflate = !1;
+        takeover = !0;
+      }
+
+      // returns the status to close with if the peer broke the protocol or
+      // sent something too big, after which nothing more is decoded
+      std::optional<status> feed(std::string_view recvd, decode_callback func) {
+        // finish off whatever frame was left over from the last read first,
+        // copying no more of recvd than that frame needs
+        while (!error && !halted && head != tail && recvd.size()) {
+          auto first = read_header(pending());
+
+          if (first && !admit(*first))
+            break;
+
+          auto need = first ?
+            first->size + first->length - pending().size() :
+            MAXHEADER - pending().size();
+
+          auto take = std::min<size_t>(need, recvd.size());
+
+          store(recvd.substr(0, take));
+          recvd.remove_prefix(take);
+
+          head += parse(pending(), func);
+
+          if (head == tail)
+            head = tail = 0;
+        }
+
+        if (error || halted || head != tail)
+          return error;
+
+        auto used = parse(recvd, func);
+
+        if (!error && !halted)
+          store(recvd.substr(used));
+
+        return error;
+      }
+
+      // nothing more is decoded until the next reset, not even the rest of
+      // the read being fed
+      void halt() {
+        halted = !0;
+      }
+
+      // number of bytes held back waiting on the rest of a frame
+      size_t buffered() {
+        return tail - head;
+      }
+  };
 }
 
 namespace ptyps::web::wss {
@@ -283,40 +816,261 @@ namespace ptyps::web::wss {
   class Socket : ptyps::web::tcps::Socket {
     private:
     ptyps::web::url::parsed parsed;
-    std::string rxbuf;
+    ptyps::web::http::Response response;
+    ptyps::web::ws::Decoder decoder;
+    ptyps::metrics::Histogram latency;
+    std::string key;
+    uint64_t pinger = 0;
     state cond;
 
+    // the payload of the last ping, until its pong comes back
+    std::atomic<int64_t> pinged = 0;
+
+    // permessage-deflate as the server agreed to it, and our context for
+    // what goes out; both are only touched with squeezing held
+    std::optional<ptyps::web::ws::deflate_params> agreed;
+    std::unique_ptr<ptyps::zlib::Deflater> deflater;
+    std::mutex squeezing;
+
+    // settled once the upgrade is through (or isn't going to be)
+    std::optional<std::promise<void>> opening;
+    uint64_t upgrade = 0;
+    std::chrono::steady_clock::time_point upgraded;
+
+    void opened(std::optional<std::string> why = {}) {
+      ptyps::web::tcps::Socket::cancel(upgrade);
+      upgrade = 0;
+
+      auto done = std::move(opening);
+      opening.reset();
+
+      if (!done)
+        return;
+
+      if (why)
+        return done->set_exception(std::make_exception_ptr(ptyps::err::exception(*why)));
+
+      done->set_value();
+    }
+
+    // the 101 has to upgrade to websocket and prove it read our key
+    bool accepted() {
+      if (response.status() != 101)
+        return !1;
+
+      if (!response.lists("Upgrade", "websocket") || !response.lists("Connection", "Upgrade"))
+        return !1;
+
+      auto accept = response.header("Sec-WebSocket-Accept");
+
+      if (!accept || *accept != ptyps::web::ws::createAcceptKey(key))
+        return !1;
+
+      return negotiate();
+    }
+
+    // any extension the server answers with has to be one we offered
+    bool negotiate() {
+      auto header = response.header("Sec-WebSocket-Extensions");
+
+      if (!header)
+        return !0;
+
+      if (!compression.enabled)
+        return !1;
+
+      auto guard = std::lock_guard(squeezing);
+
+      agreed = ptyps::web::ws::agree(*header, compression);
+
+      if (!agreed)
+        return !1;
+
+      decoder.deflate = !0;
+      decoder.takeover = !agreed->server_no_context_takeover;
+
+      return !0;
+    }
+
+    int window() {
+      return -agreed->client_max_window_bits;
+    }
+
+    // compresses a message and queues it as one, so messages go out in the
+    // order our context saw them; squeezing has to be held
+    void squeeze(opcode op, std::string_view data) {
+      if (!deflater)
+        deflater = ptyps::zlib::deflaters.take(window(), compression.level);
+
+      auto packed = std::string_view();
+
+      try {
+        packed = deflater->message(data);
+      }
+
+      // nothing went out, but the context can't be trusted; a new one
+      // is fine by the other end, with takeover or not
+      catch (const std::exception &err) {
+        deflater.reset();
+        throw;
+      }
+
+      auto head = ptyps::web::ws::header_buffer();
+      auto key = ptyps::web::ws::createMaskingKey();
+      auto body = std::string(packed);
+
+      auto size = ptyps::web::ws::encode_header(head, op, body.size(), key, !0, !0);
+
+      ptyps::web::ws::mask(body.data(), body.size(), key);
+
+      ptyps::web::tcps::Socket::write(std::string(head.data(), size), std::move(body));
+
+      if (agreed->client_no_context_takeover)
+        ptyps::zlib::deflaters.give(std::move(deflater), window(), compression.level);
+    }
+
+    // sends a control frame, the payload (125 bytes at most) is masked on
+    // the stack so nothing is allocated
+    void control(opcode op, std::string_view payload) {
+      auto head = ptyps::web::ws::header_buffer();
+      auto key = ptyps::web::ws::createMaskingKey();
+
+      char masked[125];
+
+      std::memcpy(masked, payload.data(), payload.size());
+      ptyps::web::ws::mask(masked, payload.size(), key);
+
+      auto size = ptyps::web::ws::encode_header(head, op, payload.size(), key);
+
+      std::string_view list[] = {
+        std::string_view(head.data(), size),
+        std::string_view(masked, payload.size())
+      };
+
+      ptyps::web::tcps::Socket::write(list);
+    }
+
+    // our pings carry the time they were sent, so the pong gives the rtt
+    void pong_recvd(std::string_view payload) {
+      if (payload.size() != sizeof(int64_t))
+        return;
+
+      auto sent = int64_t();
+      std::memcpy(&sent, payload.data(), sizeof(sent));
+
+      // unsolicited, or for a ping that's been overtaken by another
+      auto expected = sent;
+
+      if (!sent || !pinged.compare_exchange_strong(expected, 0))
+        return;
+
+      auto now = std::chrono::steady_clock::now().time_since_epoch();
+      auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now).count() - sent;
+
+      if (rtt >= 0)
+        latency.record(rtt);
+    }
+
     public:
       using ptyps::web::tcps::Socket::connected;
+      using ptyps::web::tcps::Socket::connecting;
+      using ptyps::web::tcps::Socket::handshaking;
+      using ptyps::web::tcps::Socket::timing;
+      using ptyps::web::tcps::Socket::resumed;
+      using ptyps::web::tcps::Socket::offload;
+      using ptyps::web::tcps::Socket::offloaded;
       using ptyps::web::tcps::Socket::loop;
+      using ptyps::web::tcps::Socket::pending;
+      using ptyps::web::tcps::Socket::highwater;
+      using ptyps::web::tcps::Socket::attach;
+      using ptyps::web::tcps::Socket::disconnect;
+      using ptyps::web::tcps::Socket::every;
+      using ptyps::web::tcps::Socket::after;
+      using ptyps::web::tcps::Socket::cancel;
 
       virtual void ws_on_disconnect() { }
       virtual void ws_on_connect() { }
+      virtual void ws_on_fail(std::string_view why) { }
       virtual void ws_on_open() { }
       virtual void ws_on_close(ptyps::web::ws::status) { }
-      virtual void ws_on_text(std::string text) {}
+      virtual void ws_on_text(std::string_view text) {}
+
+      virtual void ws_on_binary(std::span<const std::byte> data) {}
+
+      // only called once streaming(true) is set, in place of ws_on_text and
+      // ws_on_binary; op is TEXT or BINARY for every piece of a message
+      virtual void ws_on_fragment(opcode op, std::string_view piece, bool fin) {}
+
+      // see tcps::Socket::highwater for when this fires
+      virtual void ws_on_backpressure(bool pressured) {}
+
+      void tcp_on_backpressure(bool pressured) {
+        ws_on_backpressure(pressured);
+      }
+
+      void tcp_on_fail(std::string_view why) {
+        ws_on_fail(why);
+        opened(std::string(why));
+      }
 
       void tcp_on_disconnect() {
+        auto before = cond;
+
         cond = state::CLOSE;
 
+        if (before == state::CONNECTING)
+          opened("websocket upgrade failed");
+
         ws_on_disconnect();
-     }
-     
+      }
+
       void tcp_on_connect() {
         cond = state::CONNECTING;
+        key = ptyps::web::ws::createHandshakeKey();
+        response.reset();
+        decoder.reset();
+
+        {
+          auto guard = std::lock_guard(squeezing);
+
+          if (agreed)
+            ptyps::zlib::deflaters.give(std::move(deflater), window(), compression.level);
+
+          agreed.reset();
+        }
+
+        upgraded = std::chrono::steady_clock::now();
+
+        upgrade = ptyps::web::tcps::Socket::after(upgrading, [this]() {
+          upgrade = 0;
+
+          if (cond == state::CONNECTING)
+            ptyps::web::tcps::Socket::disconnect();
+        });
 
         ws_on_connect();
 
         auto list = std::vector<std::string>();
 
-        auto top = ptyps::string::format("GET /%s HTTP/1.1", parsed.query.data());
+        auto path = parsed.path.size() ? parsed.path : "/";
+        auto top = ptyps::string::format("GET %s%s HTTP/1.1", path.data(), parsed.query.data());
 
         list.push_back(top);
-        list.push_back("Host: " + parsed.host);
+        auto secure = parsed.protocol == "wss" || parsed.protocol == "https";
+        auto authority = parsed.host;
+
+        if (parsed.port != (secure ? 443 : 80))
+          authority += ":" + std::to_string(parsed.port);
+
+        list.push_back("Host: " + authority);
         list.push_back("Upgrade: websocket");
         list.push_back("Connection: Upgrade");
-        list.push_back("Sec-WebSocket-Key: " + ptyps::web::ws::createHandshakeKey());
+        list.push_back("Sec-WebSocket-Key: " + key);
         list.push_back("Sec-WebSocket-Version: 13");
+
+        if (compression.enabled)
+          list.push_back("Sec-WebSocket-Extensions: " + ptyps::web::ws::offer(compression));
+
         list.push_back({});
         list.push_back({});
 
@@ -325,22 +1079,34 @@ namespace ptyps::web::wss {
         ptyps::web::tcps::Socket::write(request);
       }
 
-      void tcp_on_recvd(std::string recvd) {
+      void tcp_on_recvd(std::string_view data) {
         if (cond == state::CONNECTING) {
-          auto response = ptyps::string::split<std::list>(recvd, "\r\n");
-
-          auto top = ptyps::funcs::pop(response);
+          auto [progress, used] = response.feed(data);
 
-          if (!top || top != "HTTP/1.1 101 Switching Protocols")
+          if (progress == ptyps::web::http::progress::INCOMPLETE)
             return;
 
+          if (progress == ptyps::web::http::progress::FAIL || !accepted())
+            return ptyps::web::tcps::Socket::disconnect();
+
           cond = state::OPEN;
 
-          return ws_on_open();
+          auto took = std::chrono::steady_clock::now() - upgraded;
+          times.upgrade = std::chrono::duration_cast<std::chrono::microseconds>(took);
+
+          opened();
+
+          ws_on_open();
+
+          // frames that came in the same read as the response
+          data.remove_prefix(used);
+
+          if (data.empty())
+            return;
         }
 
         if (cond == state::OPEN) {
-          ptyps::web::ws::decode(recvd, rxbuf, [&](opcode opcode, ptyps::web::ws::decode_variant vari) {
+          auto handle = [&](opcode opcode, ptyps::web::ws::decode_variant vari, bool fin) {
             if (opcode == opcode::CLOSE) {
               cond = state::CLOSING;
 
@@ -348,29 +1114,171 @@ namespace ptyps::web::wss {
               return ws_on_close(code);
             }
 
-            if (opcode == opcode::TEXT) {
-              auto text = std::get<std::string>(vari);
-              return ws_on_text(text);
+            if (opcode == opcode::PING)
+              return control(opcode::PONG, std::get<std::string_view>(vari));
+
+            if (opcode == opcode::PONG)
+              return pong_recvd(std::get<std::string_view>(vari));
+
+            if (opcode == opcode::TEXT || opcode == opcode::BINARY) {
+              auto data = std::get<std::string_view>(vari);
+
+              if (decoder.stream)
+                return ws_on_fragment(opcode, data, fin);
+
+              if (opcode == opcode::BINARY)
+                return ws_on_binary(std::as_bytes(std::span(data)));
+
+              return ws_on_text(data);
             }
+          };
+
+          // a handler that closed or dropped the connection has seen the
+          // last of it, and data may have been freed with it
+          auto error = decoder.feed(data, [&](opcode opcode, ptyps::web::ws::decode_variant vari, bool fin) {
+            handle(opcode, vari, fin);
+
+            if (cond != state::OPEN)
+              decoder.halt();
           });
-        }
 
-        if (cond == state::CLOSING) {
-          printf(recvd.data());
+          if (error)
+            return close(*error);
         }
       }
 
+      // how long the server gets to answer the upgrade request
+      std::chrono::milliseconds upgrading = std::chrono::seconds(10);
+
+      // permessage-deflate to offer, set before connecting; the contexts
+      // it needs come from ptyps::zlib's pools and go back to them
+      ptyps::web::ws::deflate_settings compression;
+
       Socket(std::string_view addr) : ptyps::web::tcps::Socket() {
         parsed = ptyps::web::url::parse(&addr[0]);
       }
 
-      void connect() {
+      ~Socket() {
+        ptyps::web::tcps::Socket::cancel(pinger);
+        ptyps::web::tcps::Socket::disconnect();
+
+        if (agreed)
+          ptyps::zlib::deflaters.give(std::move(deflater), window(), compression.level);
+      }
+
+      // ready once the socket is open, throws if it didn't get that far
+      std::future<void> connect() {
+        if (ptyps::web::tcps::Socket::stage() != ptyps::web::tcps::phase::IDLE)
+          throw ptyps::err::exception("socket is already connected");
+
+        opening = std::promise<void>();
+
+        auto out = opening->get_future();
+
         ptyps::web::tcps::Socket::connect(parsed.port, parsed.host);
+
+        return out;
+      }
+
+      // the server's upgrade response, valid once ws_on_open has been called
+      const ptyps::web::http::Response &handshake() {
+        return response;
+      }
+
+      // largest message accepted before closing with MSG_TOO_BIG, 0 for no limit
+      void limit(size_t bytes) {
+        decoder.max = bytes;
+      }
+
+      // where the next connect() goes, for a socket that's been moved on
+      void redirect(std::string_view addr) {
+        parsed = ptyps::web::url::parse(std::string(addr));
+      }
+
+      // hand fragments to ws_on_fragment as they arrive instead of reassembling
+      void streaming(bool enabled) {
+        decoder.stream = enabled;
+      }
+
+      void ping() {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        auto sent = int64_t(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+
+        pinged = sent;
+        control(opcode::PING, std::string_view((char *) &sent, sizeof(sent)));
+      }
+
+      // pings the peer every so often whenever the socket is open, from
+      // a timer on the socket's io thread that carries on through
+      // reconnects; ticks while it isn't open are skipped
+      template <typename T, typename D>
+        void pinging(std::chrono::duration<T, D> every) {
+          ptyps::web::tcps::Socket::cancel(pinger);
+
+          pinger = ptyps::web::tcps::Socket::every(every, [this]() -> bool {
+            if (connected() && cond == state::OPEN)
+              ping();
+
+            return !1;
+          });
+        }
+
+      // round trip times of our pings, in microseconds
+      ptyps::metrics::Histogram &rtt() {
+        return latency;
+      }
+
+      void close(status code) {
+        uint8_t payload[2];
+
+        ptyps::web::ws::UInt16ToUInt8(std::underlying_type_t<status>(code), payload);
+
+        cond = state::CLOSING;
+
+        control(opcode::CLOSE, std::string_view((char *) payload, sizeof(payload)));
+      }
+
+      // what the server agreed to, once open; empty if it didn't offer to
+      // compress anything
+      std::optional<ptyps::web::ws::deflate_params> deflated() {
+        auto guard = std::lock_guard(squeezing);
+        return agreed;
+      }
+
+      // the payload is masked where it is and queued alongside its header,
+      // safe to call from any thread. with permessage-deflate, messages
+      // from compression.threshold up are compressed first; raw deflate
+      // can't do the 8 bit window, so a server asking for it gets none
+      void send(opcode op, std::string data) {
+        auto big = compression.threshold && data.size() >= compression.threshold;
+
+        if (compression.enabled && big && (op == opcode::TEXT || op == opcode::BINARY)) {
+          auto guard = std::lock_guard(squeezing);
+
+          if (agreed && agreed->client_max_window_bits > 8)
+            return squeeze(op, data);
+        }
+
+        auto head = ptyps::web::ws::header_buffer();
+        auto key = ptyps::web::ws::createMaskingKey();
+
+        auto size = ptyps::web::ws::encode_header(head, op, data.size(), key);
+
+        ptyps::web::ws::mask(data.data(), data.size(), key);
+
+        ptyps::web::tcps::Socket::write(std::string(head.data(), size), std::move(data));
       }
 
       void write(std::string text) {
-        auto enc = ptyps::web::ws::encode(!0, ptyps::web::ws::opcode::TEXT, text);
-        ptyps::web::tcps::Socket::write(enc);
+        send(opcode::TEXT, std::move(text));
+      }
+
+      void write_binary(std::string data) {
+        send(opcode::BINARY, std::move(data));
+      }
+
+      void write_binary(std::span<const std::byte> data) {
+        send(opcode::BINARY, std::string((const char *) data.data(), data.size()));
       }
   };
 }
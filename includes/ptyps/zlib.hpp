@@ -0,0 +1,368 @@
+#pragma once
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+#include <string_view>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <tuple>
+#include <map>
+
+#include <zlib.h>
+
+#include "./metrics.hpp"
+#include "./error.hpp"
+
+// The gateway's compress=zlib-stream: everything sent on a connection is
+// one zlib stream, flushed at the end of every message, so a message is
+// done once the input ends with 00 00 FF FF. The stream's dictionary
+// carries over from one message to the next, which is why the inflate
+// context has to live as long as the connection does. Websocket's
+// permessage-deflate is the same thing in raw deflate (a negative window)
+// with the suffix left off, and uses append() and finish() as it knows
+// where its messages end.
+
+namespace ptyps::zlib {
+  using exception = ptyps::err::exception;
+
+  // what a sync flush leaves at the end of every message
+  constexpr char SUFFIX[] = {'\x00', '\x00', '\xff', '\xff'};
+
+  enum class progress {
+    INCOMPLETE,
+    COMPLETE,
+    FAIL
+  };
+
+  // counters for one stream, fine to read from any thread
+  struct stats {
+    public:
+      std::atomic<uint64_t> messages = 0;
+      std::atomic<uint64_t> compressed = 0; // bytes in
+      std::atomic<uint64_t> inflated = 0; // bytes out
+
+      // time spent in inflate, per message in nanoseconds
+      ptyps::metrics::Histogram time;
+
+      // how many times smaller the stream is than what it inflates to
+      double ratio() const {
+        auto in = compressed.load(std::memory_order_relaxed);
+        return in ? double(inflated.load(std::memory_order_relaxed)) / in : 0.0;
+      }
+  };
+
+  // Inflates one connection's stream a piece at a time, as it comes off
+  // the socket, so compressed messages are never put back together first.
+  // Output goes into a buffer that's kept from one message to the next and
+  // only ever grows, so once it's as big as the biggest message (READY, or
+  // a large GUILD_CREATE) inflating doesn't allocate.
+
+  class Inflater {
+    private:
+      z_stream stream = {};
+      std::string buffer;
+      size_t used = 0;
+
+      // the last bytes fed in, as the suffix can be split between pieces
+      char tail[sizeof(SUFFIX)] = {};
+      bool done = !1;
+      bool broken = !1;
+      bool oversize = !1;
+
+      // the stream came to an end (a final block), so the next message
+      // starts a new one
+      bool ended = !1;
+
+      std::chrono::steady_clock::duration spent = {};
+      size_t read = 0;
+
+      void remember(std::string_view piece) {
+        auto keep = std::min(piece.size(), sizeof(tail));
+
+        std::memmove(tail, tail + keep, sizeof(tail) - keep);
+        std::memcpy(tail + sizeof(tail) - keep, piece.data() + piece.size() - keep, keep);
+      }
+
+    public:
+      stats counters;
+
+      // most a message may inflate to, 0 for no limit; append() fails
+      // before the buffer grows any further than that
+      size_t max = 0;
+
+      // window is zlib's windowBits, negative for raw deflate
+      Inflater(int window = 15, size_t reserve = 64 * 1024) : buffer(reserve, '\0') {
+        if (::inflateInit2(&stream, window) != Z_OK)
+          throw exception("unable to init inflate stream");
+      }
+
+      Inflater(const Inflater &) = delete;
+
+      ~Inflater() {
+        ::inflateEnd(&stream);
+      }
+
+      // for a new connection, which starts a new stream; the buffer stays
+      void reset() {
+        ::inflateReset(&stream);
+
+        std::memset(tail, 0, sizeof(tail));
+        used = read = 0;
+        spent = {};
+        done = broken = oversize = ended = !1;
+      }
+
+      // inflates piece onto the end of the message so far, false if the
+      // stream's broken or the message came out bigger than most (max if
+      // it's 0), which oversized() tells apart
+      bool append(std::string_view piece, size_t most = 0) {
+        if (broken)
+          return !1;
+
+        if (!most)
+          most = max;
+
+        // the last message has been looked at, its space can go again
+        if (done) {
+          used = read = 0;
+          spent = {};
+          done = !1;
+
+          // a permessage-deflate sender can end a message with BFINAL
+          // set (RFC 7692 7.2.3.3), after which there's no stream left
+          if (ended)
+            ::inflateReset(&stream);
+
+          ended = !1;
+        }
+
+        // anything after the end is the suffix (or an empty block) that
+        // came with the message, there's nothing more in it
+        if (ended) {
+          read += piece.size();
+          return !0;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        stream.next_in = (Bytef *) piece.data();
+        stream.avail_in = piece.size();
+
+        // a full buffer can mean there's more to come out, input or not
+        while (stream.avail_in || !stream.avail_out) {
+          if (most && used > most)
+            break;
+
+          if (used == buffer.size())
+            buffer.resize(most ? std::min(buffer.size() * 2, most + 1) : buffer.size() * 2);
+
+          // one byte past most is room enough to know it's too big
+          auto room = most ? std::min(buffer.size(), most + 1) : buffer.size();
+
+          stream.next_out = (Bytef *) buffer.data() + used;
+          stream.avail_out = room - used;
+
+          auto i = ::inflate(&stream, Z_SYNC_FLUSH);
+
+          used = room - stream.avail_out;
+
+          if (i == Z_STREAM_END) {
+            ended = !0;
+            break;
+          }
+
+          // BUF_ERROR is only no progress, which the resize above sorts out
+          if (i != Z_OK && i != Z_BUF_ERROR) {
+            broken = !0;
+            return !1;
+          }
+        }
+
+        if (most && used > most) {
+          broken = oversize = !0;
+          return !1;
+        }
+
+        spent += std::chrono::steady_clock::now() - start;
+        read += piece.size();
+
+        return !0;
+      }
+
+      // whether append() failed as the message was bigger than allowed
+      bool oversized() const {
+        return oversize;
+      }
+
+      // the message is all in, data() has it until the next append
+      void finish() {
+        done = !0;
+
+        counters.messages.fetch_add(1, std::memory_order_relaxed);
+        counters.compressed.fetch_add(read, std::memory_order_relaxed);
+        counters.inflated.fetch_add(used, std::memory_order_relaxed);
+        counters.time.record(std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count());
+      }
+
+      // inflates piece, which is the next part of the stream however the
+      // frames split it; COMPLETE once a message's last piece is in, then
+      // data() has it until the next feed
+      progress feed(std::string_view piece) {
+        if (!append(piece))
+          return progress::FAIL;
+
+        remember(piece);
+
+        if (std::memcmp(tail, SUFFIX, sizeof(SUFFIX)))
+          return progress::INCOMPLETE;
+
+        finish();
+
+        return progress::COMPLETE;
+      }
+
+      // the message that last came out COMPLETE (or what's been appended
+      // so far), a view into the buffer
+      std::string_view data() {
+        return std::string_view(buffer.data(), used);
+      }
+
+      // how much the buffer's grown to
+      size_t capacity() {
+        return buffer.size();
+      }
+  };
+
+  // The other way, one message at a time with a sync flush after each, so
+  // every message ends on SUFFIX and the stream's context carries on into
+  // the next unless it's reset().
+
+  class Deflater {
+    private:
+      z_stream stream = {};
+      std::string buffer;
+
+    public:
+      // window is zlib's windowBits, negative for raw deflate
+      Deflater(int window = 15, int level = Z_DEFAULT_COMPRESSION) {
+        if (::deflateInit2(&stream, level, Z_DEFLATED, window, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+          throw exception("unable to init deflate stream");
+      }
+
+      Deflater(const Deflater &) = delete;
+
+      ~Deflater() {
+        ::deflateEnd(&stream);
+      }
+
+      // forgets the context, the next message is compressed on its own
+      void reset() {
+        ::deflateReset(&stream);
+      }
+
+      // compresses data, the view is good until the next feed
+      std::string_view feed(std::string_view data) {
+        auto bound = ::deflateBound(&stream, data.size()) + 16;
+
+        if (buffer.size() < bound)
+          buffer.resize(bound);
+
+        stream.next_in = (Bytef *) data.data();
+        stream.avail_in = data.size();
+
+        auto used = size_t(0);
+
+        // the flush isn't done until it leaves room to spare
+        do {
+          if (used == buffer.size())
+            buffer.resize(buffer.size() * 2);
+
+          stream.next_out = (Bytef *) buffer.data() + used;
+          stream.avail_out = buffer.size() - used;
+
+          auto i = ::deflate(&stream, Z_SYNC_FLUSH);
+
+          used = buffer.size() - stream.avail_out;
+
+          // BUF_ERROR is only no progress, which more room sorts out
+          if (i != Z_OK && i != Z_BUF_ERROR)
+            throw exception("unable to deflate message");
+        } while (!stream.avail_out);
+
+        return std::string_view(buffer.data(), used);
+      }
+
+      // data as one permessage-deflate message, which is feed() without
+      // the flush's 00 00 FF FF for the other end to put back
+      std::string_view message(std::string_view data) {
+        // a flush with nothing new to flush writes nothing, but a stored
+        // block's header is as good (RFC 7692 7.2.3.6)
+        if (data.empty())
+          return std::string_view("\x00", 1);
+
+        auto packed = feed(data);
+
+        if (packed.size() < sizeof(SUFFIX) || std::memcmp(packed.data() + packed.size() - sizeof(SUFFIX), SUFFIX, sizeof(SUFFIX)))
+          throw exception("deflated message doesn't end in a flush");
+
+        packed.remove_suffix(sizeof(SUFFIX));
+        return packed;
+      }
+  };
+
+  // -----
+
+  // Contexts put aside for whoever needs one next, by what they were made
+  // with. Making one costs a few allocations (deflate's come to a few
+  // hundred KB), which would otherwise be paid on every connect, or on
+  // every message where there's no context takeover.
+
+  template <typename T, typename ...A>
+    class Pool {
+      private:
+        std::mutex lock;
+        std::map<std::tuple<A...>, std::vector<std::unique_ptr<T>>> idle;
+
+      public:
+        // most kept for any one set of args, the rest are freed
+        size_t limit = 64;
+
+        std::unique_ptr<T> take(A... args) {
+          {
+            auto guard = std::lock_guard(lock);
+            auto &list = idle[{args...}];
+
+            if (list.size()) {
+              auto out = std::move(list.back());
+              list.pop_back();
+
+              return out;
+            }
+          }
+
+          return std::make_unique<T>(args...);
+        }
+
+        // reset as it goes back, it's as good as new for the next taker
+        void give(std::unique_ptr<T> ctx, A... args) {
+          if (!ctx)
+            return;
+
+          ctx->reset();
+
+          auto guard = std::lock_guard(lock);
+          auto &list = idle[{args...}];
+
+          if (list.size() < limit)
+            list.push_back(std::move(ctx));
+        }
+    };
+
+  inline Pool<Inflater, int> inflaters;
+  inline Pool<Deflater, int, int> deflaters;
+}
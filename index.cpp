@@ -20,14 +20,14 @@ class Bot : public ptyps::web::discord::Gateway {
       printf("Gateway is closing\r\n");
     }
 
-    void gateway_on_ready(ptyps::json::obj data) {
-      auto text = ptyps::json::stringify(data);
+    void gateway_on_ready(const ptyps::web::discord::Payload &data) {
+      auto text = ptyps::json::stringify(data.json());
 
       printf("READY: %s\r\n", text.data());
     }
 
-    void gateway_on_guild_create(ptyps::json::obj data) {
-      auto text = ptyps::json::stringify(data);
+    void gateway_on_guild_create(const ptyps::web::discord::Payload &data) {
+      auto text = ptyps::json::stringify(data.json());
 
       printf("GUILD: %s\r\n", text.data());
     }
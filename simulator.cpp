@@ -0,0 +1,237 @@
+#include "includes/ptyps/web/simulator.hpp"
+#include "includes/ptyps/web/discord.hpp"
+#include "includes/ptyps/web/cache.hpp"
+#include "includes/ptyps/metrics.hpp"
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+// Drives Gateway clients against a local simulator::Server and reports
+// what it took to handle the dispatches. The server runs in a child
+// process, so the cpu figures are the clients' alone.
+//
+//   ./dist/simulator --shards 4 --rate 5000 --events 20000 --members 1000
+//   ./dist/simulator --encoding etf --compress 1
+
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include <cstring>
+#include <vector>
+#include <map>
+
+using clock_type = std::chrono::steady_clock;
+
+static ptyps::metrics::Histogram latency;
+static std::atomic<uint64_t> handled = 0;
+static std::atomic<uint64_t> opened = 0;
+
+class Bench : public ptyps::web::discord::ShardManager {
+  private:
+    bool etf;
+
+    void shards_on_open(int shard) {
+      ::opened++;
+    }
+
+    // parses every d, as a bot handling all of them would; terms are read
+    // in place, there's nothing to build. what's replayed after a RESUME
+    // was lost the first time, so it counts, RESUMED itself doesn't
+    void shards_on_dispatch(int shard, std::string_view event, std::string_view text) {
+      auto sent = etf ?
+        ptyps::etf::value<int64_t>(ptyps::etf::Term(text), "sim_sent") :
+        ptyps::json::value<int64_t>(ptyps::json::parse(text), "sim_sent");
+
+      if (event == "RESUMED")
+        return;
+
+      if (sent) {
+        auto took = ptyps::web::simulator::stamp() - *sent;
+        ::latency.record(std::max<int64_t>(took / 1000, 0));
+      }
+
+      handled++;
+    }
+
+  public:
+    // asks the simulator's /gateway/bot how many shards to run
+    Bench(uint16_t port, std::string encoding, bool compress, size_t threads) : ptyps::web::discord::ShardManager(ptyps::json::object({
+      {"token", "simulated"},
+      {"api", "https://127.0.0.1:" + std::to_string(port)},
+      {"encoding", encoding},
+      {"compress", compress}
+    }), threads), etf(encoding == "etf") {
+      dispatches(!0);
+    }
+};
+
+static double cpu_seconds() {
+  auto usage = rusage();
+  ::getrusage(RUSAGE_SELF, &usage);
+
+  auto user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  auto system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+  return user + system;
+}
+
+int main(int argc, char** argv) {
+  auto opts = ptyps::web::simulator::options();
+  auto threads = ptyps::web::reactor::threads;
+  auto spacing = 0;
+  auto retry = 100;
+  auto timeout = 60;
+
+  auto args = std::map<std::string, std::string>();
+
+  for (auto i = 1; i + 1 < argc; i += 2)
+    args[argv[i]] = argv[i + 1];
+
+  auto number = [&](std::string name, auto fallback) {
+    auto found = args.find("--" + name);
+    return found == args.end() ? fallback : decltype(fallback)(std::stod(found->second));
+  };
+
+  auto encoding = args.count("--encoding") ? args["--encoding"] : "json";
+  auto compress = false;
+  auto cached = false;
+
+  threads = number("threads", threads);
+  spacing = number("spacing", spacing);
+  retry = number("retry", retry);
+  timeout = number("timeout", timeout);
+  compress = number("compress", compress);
+  cached = number("cache", cached);
+
+  opts.shards = number("shards", opts.shards);
+  opts.concurrency = number("concurrency", opts.concurrency);
+
+  opts.port = number("port", opts.port);
+  opts.heartbeat = number("heartbeat", opts.heartbeat);
+  opts.ack = number("ack", opts.ack);
+  opts.guilds = number("guilds", opts.guilds);
+  opts.members = number("members", opts.members);
+  opts.rate = number("rate", opts.rate);
+  opts.events = number("events", opts.events);
+  opts.content = number("content", opts.content);
+  opts.reconnect = number("reconnect", opts.reconnect);
+  opts.invalidate = number("invalidate", opts.invalidate);
+  opts.drop = number("drop", opts.drop);
+
+  // made up front so both processes have it and clients can trust it
+  auto cert = std::make_shared<ptyps::web::simulator::Certificate>();
+  auto trust = std::string("/tmp/simulator-") + std::to_string(::getpid()) + ".pem";
+
+  cert->save(trust);
+
+  int ready[2];
+
+  if (::pipe(ready) == EOF)
+    return 1;
+
+  auto child = ::fork();
+
+  if (child == 0) {
+    ::close(ready[0]);
+
+    // don't outlive the clients if they crash
+    ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    auto server = ptyps::web::simulator::Server(opts, cert);
+
+    // the port it got, in case it was asked for any
+    auto port = server.port();
+    [[maybe_unused]] auto i = ::write(ready[1], &port, sizeof(port));
+
+    while (!0)
+      ptyps::time::wait(std::chrono::seconds(1));
+  }
+
+  ::close(ready[1]);
+
+  if (::read(ready[0], &opts.port, sizeof(opts.port)) != sizeof(opts.port)) {
+    printf("simulator failed to start\r\n");
+    return 1;
+  }
+
+  ptyps::web::ssl::settings.ca_file = trust;
+
+  auto expected = uint64_t(opts.shards) * (opts.events + opts.guilds + 1);
+
+  auto bench = Bench(opts.port, encoding, compress, threads);
+
+  // the simulator doesn't hold anyone to discord's 5s
+  bench.spacing = std::chrono::milliseconds(spacing);
+  bench.retry = std::chrono::milliseconds(retry);
+
+  auto store = ptyps::web::cache::Cache();
+
+  if (cached)
+    store.attach(bench);
+
+  auto cpu = cpu_seconds();
+  auto start = clock_type::now();
+
+  bench.start();
+
+  auto deadline = start + std::chrono::seconds(timeout);
+
+  while (handled < expected && clock_type::now() < deadline)
+    ptyps::time::wait(std::chrono::milliseconds(10));
+
+  auto elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+  auto used = cpu_seconds() - cpu;
+  auto count = handled.load();
+
+  printf("encoding %s, shards %u opened %lu, events %lu of %lu in %.2fs\r\n", encoding.c_str(), opts.shards, ::opened.load(), count, expected, elapsed);
+  printf("throughput %.0f events/s, resumes %lu replaying %lu events\r\n", count / elapsed, bench.resumes(), bench.replays());
+  printf("latency us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\r\n",
+    latency.percentile(50), latency.percentile(90), latency.percentile(99), latency.percentile(99.9), latency.max());
+  printf("cpu %.3fs, %.2fus per event\r\n", used, count ? used * 1e6 / count : 0.0);
+
+  // the slowest shard's, if any beats went out
+  auto acked = uint64_t(0), p50 = uint64_t(0), p99 = uint64_t(0);
+
+  for (auto i = 0; i < int(bench.size()); i++) {
+    auto &lag = bench.shard(i).latency();
+
+    acked += lag.count();
+    p50 = std::max(p50, lag.percentile(50));
+    p99 = std::max(p99, lag.percentile(99));
+  }
+
+  if (acked || bench.zombies())
+    printf("heartbeats %lu acked, us p50 %lu p99 %lu, zombies %lu\r\n", acked, p50, p99, bench.zombies());
+
+  if (cached) {
+    auto usage = store.usage();
+
+    printf("cache %lu guilds %lu channels %lu roles %lu members %lu users, %lu bytes, %.1f per member\r\n",
+      usage.guilds, usage.channels, usage.roles, usage.members, usage.users, usage.bytes, usage.members ? double(usage.bytes) / usage.members : 0.0);
+  }
+
+  if (compress) {
+    auto in = uint64_t(0), out = uint64_t(0), spent = uint64_t(0), messages = uint64_t(0);
+
+    for (auto i = 0; i < int(bench.size()); i++) {
+      auto &stats = bench.shard(i).compression();
+
+      in += stats.compressed;
+      out += stats.inflated;
+      messages += stats.messages;
+      spent += stats.time.mean() * stats.time.count();
+    }
+
+    printf("zlib %lu bytes in, %lu out (%.1fx), %.2fus inflating per message\r\n", in, out, in ? double(out) / in : 0.0, messages ? spent / 1e3 / messages : 0.0);
+  }
+
+  bench.stop();
+
+  ::kill(child, SIGTERM);
+  ::waitpid(child, nullptr, 0);
+  ::unlink(trust.c_str());
+
+  // a session that's invalidated starts over, so there can be more
+  return count >= expected ? 0 : 1;
+}
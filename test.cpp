@@ -0,0 +1,441 @@
+#include "includes/ptyps/web/discord.hpp"
+#include "includes/ptyps/web/dns.hpp"
+#include "includes/ptyps/web/ws.hpp"
+#include "includes/ptyps/zlib.hpp"
+#include "includes/ptyps/etf.hpp"
+
+// Copyright (C) 2022 Dave Perry (dbdii407)
+
+// Round trips through etf::encode(), etf::decode() and etf::to_json(),
+// plus frames written out by hand for what the encoder never makes and
+// broken ones decode() has to turn away, dispatch payloads, zlib's limits
+// and the resolver.
+//
+//   make test && ./dist/test
+
+#include <unistd.h>
+
+#include <fstream>
+#include <cstdio>
+#include <vector>
+
+static auto failures = 0;
+
+static void check(const std::string &name, bool good) {
+  if (!good)
+    failures++;
+
+  printf("%s %s\r\n", good ? "ok  " : "FAIL", name.c_str());
+}
+
+// a frame from its bytes, the version byte included
+static std::string frame(std::initializer_list<uint8_t> bytes) {
+  return std::string(bytes.begin(), bytes.end());
+}
+
+static std::optional<ptyps::json::obj> decoded(std::string_view data) {
+  auto term = ptyps::etf::decode(data);
+
+  if (!term)
+    return {};
+
+  return ptyps::etf::to_json(*term);
+}
+
+// -----
+
+// json that has to come back exactly as it went in
+static void roundtrips() {
+  auto corpus = std::vector<std::pair<std::string, ptyps::json::obj>>{
+    {"null", nullptr},
+    {"true", !0},
+    {"false", !1},
+    {"zero", 0},
+    {"small integer", 255},
+    {"integer", 256},
+    {"negative integer", -1},
+    {"int32 max", INT32_MAX},
+    {"int32 min", INT32_MIN},
+    {"past int32 max", int64_t(INT32_MAX) + 1},
+    {"past int32 min", int64_t(INT32_MIN) - 1},
+    {"2^53", int64_t(1) << 53},
+    {"-2^53", -(int64_t(1) << 53)},
+    {"float", 1.5},
+    {"negative float", -0.25},
+    {"huge float", 1e300},
+    {"empty string", ""},
+    {"string", "hello there"},
+    {"utf8 string", "h\xc3\xa9llo \xe2\x9c\x93"},
+    {"empty list", boost::json::array()},
+    {"empty map", boost::json::object()},
+    {"list", ptyps::json::parse(R"([1,"two",3.5,null,true,false])")},
+    {"nested lists", ptyps::json::parse(R"([[],[[1]],[[],[2,[3]]]])")},
+    {"map", ptyps::json::parse(R"({"op":0,"s":42,"t":"READY","d":null})")},
+    {"nested maps", ptyps::json::parse(R"({"d":{"user":{"id":"80351110224678912","flags":[]},"guilds":[{"id":"1","unavailable":true}]}})")},
+  };
+
+  for (auto &[name, value] : corpus) {
+    auto out = decoded(ptyps::etf::encode(value));
+    check("roundtrip " + name, out && *out == value);
+  }
+}
+
+// integers a json number can't hold exactly come back as strings, as ids
+// do in json
+static void bigs() {
+  auto cases = std::vector<std::tuple<std::string, ptyps::json::obj, ptyps::json::obj>>{
+    {"2^53 + 1", (int64_t(1) << 53) + 1, "9007199254740993"},
+    {"int64 max", INT64_MAX, "9223372036854775807"},
+    {"int64 min", INT64_MIN, "-9223372036854775808"},
+    {"past int64 max", uint64_t(INT64_MAX) + 1, "9223372036854775808"},
+    {"uint64 max", UINT64_MAX, "18446744073709551615"},
+  };
+
+  for (auto &[name, value, expect] : cases) {
+    auto out = decoded(ptyps::etf::encode(value));
+    check("big " + name, out && *out == expect);
+  }
+
+  // what erlang's term_to_binary would send, which isn't always how the
+  // encoder would have written it
+  auto written = std::vector<std::tuple<std::string, std::string, ptyps::json::obj>>{
+    {"small big one", frame({131, 110, 1, 0, 1}), 1},
+    {"small big negative one", frame({131, 110, 1, 1, 1}), -1},
+    {"small big zero digits", frame({131, 110, 0, 0}), 0},
+    {"small big int64 max", frame({131, 110, 8, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f}), "9223372036854775807"},
+    {"small big int64 min", frame({131, 110, 8, 1, 0, 0, 0, 0, 0, 0, 0, 0x80}), "-9223372036854775808"},
+    {"small big uint64 max", frame({131, 110, 8, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}), "18446744073709551615"},
+    {"small big leading zeros", frame({131, 110, 10, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0}), 7},
+    {"small big past uint64", frame({131, 110, 9, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1}), nullptr},
+    {"small big past int64 min", frame({131, 110, 8, 1, 1, 0, 0, 0, 0, 0, 0, 0x80}), nullptr},
+    {"large big", frame({131, 111, 0, 0, 0, 2, 0, 0x34, 0x12}), 0x1234},
+    {"large big uint64 max", frame({131, 111, 0, 0, 0, 8, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}), "18446744073709551615"},
+    {"large big negative", frame({131, 111, 0, 0, 0, 1, 1, 5}), -5},
+  };
+
+  for (auto &[name, data, expect] : written) {
+    auto out = decoded(data);
+    check(name, out && *out == expect);
+  }
+
+  auto min = ptyps::etf::decode(frame({131, 110, 8, 1, 0, 0, 0, 0, 0, 0, 0, 0x80}));
+  check("small big int64 min as integer", min && min->integer() == INT64_MIN);
+
+  auto max = ptyps::etf::decode(frame({131, 110, 8, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}));
+  check("small big uint64 max as snowflake", max && max->snowflake() == UINT64_MAX && !max->integer());
+}
+
+// terms the encoder doesn't write but the gateway can send
+static void written() {
+  auto cases = std::vector<std::tuple<std::string, std::string, ptyps::json::obj>>{
+    {"small atom nil", frame({131, 115, 3, 'n', 'i', 'l'}), nullptr},
+    {"atom true", frame({131, 100, 0, 4, 't', 'r', 'u', 'e'}), !0},
+    {"atom utf8 false", frame({131, 118, 0, 5, 'f', 'a', 'l', 's', 'e'}), !1},
+    {"other atom", frame({131, 119, 5, 'h', 'e', 'l', 'l', 'o'}), "hello"},
+    {"new float", frame({131, 70, 0x40, 0x09, 0x21, 0xfb, 0x54, 0x44, 0x2d, 0x18}), 3.141592653589793},
+    {"string ext", frame({131, 107, 0, 2, 0, 1}), ptyps::json::parse("[0,1]")},
+    {"empty string ext", frame({131, 107, 0, 0}), boost::json::array()},
+    {"string ext in a list", frame({131, 108, 0, 0, 0, 1, 107, 0, 3, 'a', 'b', 255, 106}), ptyps::json::parse("[[97,98,255]]")},
+    {"small tuple", frame({131, 104, 2, 97, 1, 97, 2}), ptyps::json::parse("[1,2]")},
+    {"nil tail", frame({131, 106}), boost::json::array()},
+  };
+
+  for (auto &[name, data, expect] : cases) {
+    auto out = decoded(data);
+    check(name, out && *out == expect);
+  }
+
+  auto string = ptyps::etf::decode(frame({131, 107, 0, 3, 7, 8, 9}));
+  check("string ext isn't text", string && !string->text());
+  check("string ext at", string && string->size() == 3 && string->at(2) && string->at(2)->integer() == 9 && !string->at(3));
+}
+
+// -----
+
+// frames decode() has to turn away rather than read past
+static void rejects() {
+  auto good = std::vector<std::string>{
+    ptyps::etf::encode(ptyps::json::parse(R"({"op":0,"s":42,"t":"READY","d":{"v":9,"user":{"id":"1"},"guilds":[{"id":"2"}],"ratio":0.5}})")),
+    ptyps::etf::encode(UINT64_MAX),
+    frame({131, 107, 0, 2, 0, 1}),
+    frame({131, 111, 0, 0, 0, 2, 0, 0x34, 0x12}),
+    frame({131, 104, 2, 97, 1, 118, 0, 1, 'x'}),
+  };
+
+  // a term says how long it is, so no part of one is a whole one
+  for (auto i = size_t(0); i < good.size(); i++) {
+    auto cut = size_t(0);
+
+    for (; cut < good[i].size(); cut++)
+      if (ptyps::etf::decode(std::string_view(good[i]).substr(0, cut)))
+        break;
+
+    check("frame " + std::to_string(i) + " truncated anywhere", cut == good[i].size() && ptyps::etf::decode(good[i]));
+    check("frame " + std::to_string(i) + " with a byte over", !ptyps::etf::decode(good[i] + '\0'));
+  }
+
+  auto bad = std::vector<std::pair<std::string, std::string>>{
+    {"empty frame", ""},
+    {"version only", frame({131})},
+    {"wrong version", frame({130, 97, 1})},
+    {"unknown tag", frame({131, 1})},
+    {"list longer than the frame", frame({131, 108, 0xff, 0xff, 0xff, 0xff, 97, 1, 106})},
+    {"map longer than the frame", frame({131, 116, 0, 0, 0, 2, 109, 0, 0, 0, 0, 106})},
+    {"list without its tail", frame({131, 108, 0, 0, 0, 1, 97, 1})},
+    {"binary longer than the frame", frame({131, 109, 0, 0, 0, 9, 'a'})},
+    {"string ext longer than the frame", frame({131, 107, 0, 9, 1})},
+    {"small big longer than the frame", frame({131, 110, 8, 0, 1})},
+    {"large big longer than the frame", frame({131, 111, 0xff, 0xff, 0xff, 0xff, 0})},
+    {"two terms", frame({131, 97, 1, 97, 2})},
+  };
+
+  for (auto &[name, data] : bad)
+    check("rejects " + name, !ptyps::etf::decode(data));
+
+  // one list inside another, deeper than anything should be
+  auto deep = frame({131});
+
+  for (auto i = 0; i <= ptyps::etf::DEPTH + 1; i++)
+    deep += frame({108, 0, 0, 0, 1});
+
+  deep += frame({106});
+
+  for (auto i = 0; i <= ptyps::etf::DEPTH + 1; i++)
+    deep += frame({106});
+
+  check("rejects nesting past DEPTH", !ptyps::etf::decode(deep));
+}
+
+// the same d read from json and from etf, where etf's is never turned
+// into json unless asked
+static void payloads() {
+  auto text = std::string(R"({"op":0,"s":3,"t":"MESSAGE_CREATE","d":{"id":"80351110224678912","author":{"id":"1","bot":true},"content":"hi","nonce":12}})");
+  auto frame = ptyps::etf::encode(ptyps::json::parse(text));
+
+  auto json = ptyps::json::Envelope(text);
+  auto etf = ptyps::etf::Envelope(frame);
+
+  auto parsed = ptyps::web::discord::Payload(json);
+  auto termed = ptyps::web::discord::Payload(etf);
+
+  for (auto data : {&parsed, &termed}) {
+    auto which = std::string(data->etf() ? "etf" : "json");
+
+    check("payload " + which + " id", data->value<uint64_t>("id") == 80351110224678912ull);
+    check("payload " + which + " nested", data->value<uint64_t>("author.id") == 1 && data->value<bool>("author.bot") == !0);
+    check("payload " + which + " string", data->value<std::string>("content") == "hi");
+    check("payload " + which + " integer", data->value<int>("nonce") == 12);
+    check("payload " + which + " missing", !data->value<int>("author.missing") && !data->value<int>("content.length"));
+  }
+
+  check("payload etf reads without json", !termed.built());
+  check("payload etf as json", termed.json() == parsed.json() && termed.built());
+}
+
+// -----
+
+// a few KB of stream that inflates to 4 MB mustn't get any further than
+// the limit before it's stopped
+static void inflates() {
+  auto deflater = ptyps::zlib::Deflater();
+  auto big = std::string(4 << 20, '\0');
+  auto packed = std::string(deflater.feed(big));
+
+  auto cases = std::vector<std::tuple<std::string, size_t, bool>>{
+    {"no limit", 0, !0},
+    {"limit the same size", big.size(), !0},
+    {"limit a byte short", big.size() - 1, !1},
+    {"limit a quarter", big.size() / 4, !1},
+  };
+
+  for (auto &[name, max, fits] : cases) {
+    auto inflater = ptyps::zlib::Inflater();
+    inflater.max = max;
+
+    auto i = inflater.feed(packed);
+
+    if (fits)
+      check("inflate " + name, i == ptyps::zlib::progress::COMPLETE && inflater.data() == big);
+
+    else
+      check("inflate " + name, i == ptyps::zlib::progress::FAIL && inflater.oversized() && inflater.capacity() <= max + 1);
+  }
+
+  // the message's own limit, as the websocket decoder passes it, wins
+  auto inflater = ptyps::zlib::Inflater();
+  check("inflate append limit", !inflater.append(packed, 1 << 20) && inflater.oversized() && inflater.capacity() <= (1 << 20) + 1);
+
+  // messages that don't compress come out a little bigger, and whole
+  auto noise = std::string(1 << 20, '\0');
+
+  for (auto &next : noise)
+    next = char(ptyps::random::word());
+
+  auto squeezer = ptyps::zlib::Deflater(-15);
+  auto unsqueezer = ptyps::zlib::Inflater(-15);
+
+  for (auto &message : {noise, big, std::string()}) {
+    auto packed = squeezer.message(message);
+    auto suffix = std::string_view(ptyps::zlib::SUFFIX, sizeof(ptyps::zlib::SUFFIX));
+    auto good = unsqueezer.append(packed) && unsqueezer.append(suffix);
+
+    unsqueezer.finish();
+    check("deflate message of " + std::to_string(message.size()), good && unsqueezer.data() == message);
+  }
+
+  // a permessage-deflate frame, which the decoder has to stop inflating
+  // once it's past max rather than find out afterwards
+  auto raw = ptyps::zlib::Deflater(-15);
+  auto body = std::string(raw.feed(big));
+
+  body.resize(body.size() - sizeof(ptyps::zlib::SUFFIX));
+
+  auto head = ptyps::web::ws::header_buffer();
+  auto size = ptyps::web::ws::encode_header(head, ptyps::web::ws::opcode::TEXT, body.size(), {}, !0, !0);
+  auto frame = std::string(head.data(), size) + body;
+
+  for (auto max : {size_t(1 << 20), big.size()}) {
+    auto decoder = ptyps::web::ws::Decoder();
+    auto out = std::string();
+
+    decoder.deflate = !0;
+    decoder.max = max;
+
+    auto error = decoder.feed(frame, [&](ptyps::web::ws::opcode op, ptyps::web::ws::decode_variant message, bool fin) {
+      out = std::get<std::string_view>(message);
+    });
+
+    if (max == big.size()) {
+      check("deflated frame up to max", !error && out == big);
+      continue;
+    }
+
+    // the inflater goes back to the pool on reset, the next one taken
+    decoder.reset();
+    auto used = ptyps::zlib::inflaters.take(ptyps::web::ws::INFLATE_WINDOW);
+
+    check("deflated frame past max", error == ptyps::web::ws::status::MSG_TOO_BIG && out.empty() && used->capacity() <= max + 1);
+  }
+}
+
+// -----
+
+static std::string first(const ptyps::web::dns::answer &found) {
+  return found.empty() ? "" : ptyps::web::net::get_addr(found[0]);
+}
+
+// the resolver against a made up source, which counts what reaches it
+static void resolvers() {
+  using namespace std::chrono_literals;
+
+  auto source = [](const std::string &host) -> ptyps::web::dns::answer {
+    if (host == "slow")
+      std::this_thread::sleep_for(300ms);
+
+    if (host == "nowhere")
+      return {};
+
+    return {*ptyps::web::net::to_endpoint("10.0.0.1")};
+  };
+
+  auto resolver = ptyps::web::dns::Resolver(source, 2);
+
+  resolver.ttl = 100ms;
+  resolver.negative = 100ms;
+
+  auto found = resolver.resolve("example").get();
+  auto again = resolver.resolve("example").get();
+  check("resolve caches", first(found) == "10.0.0.1" && first(again) == "10.0.0.1" && resolver.lookups() == 1);
+
+  std::this_thread::sleep_for(150ms);
+
+  resolver.resolve("example").get();
+  check("resolve looks up again after ttl", resolver.lookups() == 2);
+
+  auto missing = resolver.resolve("nowhere").get();
+  resolver.resolve("nowhere").get();
+  check("resolve caches failures", missing.empty() && resolver.lookups() == 3);
+
+  std::this_thread::sleep_for(150ms);
+
+  resolver.resolve("nowhere").get();
+  check("resolve looks up failures again after negative", resolver.lookups() == 4);
+
+  auto literal = resolver.resolve("127.0.0.1").get();
+  check("resolve takes addresses as they are", first(literal) == "127.0.0.1" && resolver.lookups() == 4);
+
+  resolver.pin("example", {*ptyps::web::net::to_endpoint("192.0.2.1")});
+  check("resolve pinned", first(resolver.resolve("example").get()) == "192.0.2.1" && resolver.lookups() == 4);
+
+  resolver.unpin("example");
+  resolver.forget("example");
+  check("resolve unpinned", first(resolver.resolve("example").get()) == "10.0.0.1" && resolver.lookups() == 5);
+
+  auto path = "/tmp/ptyps-hosts-" + std::to_string(::getpid());
+
+  std::ofstream(path) <<
+    "# pinned for the test\n"
+    "192.0.2.7 gateway.discord.gg gw # both names\n"
+    "::1 six\n"
+    "not-an-address ignored\n";
+
+  auto names = resolver.hosts(path);
+  ::unlink(path.c_str());
+
+  check("hosts file pins", names == 3 && first(resolver.resolve("gw").get()) == "192.0.2.7" && first(resolver.resolve("six").get()) == "::1" && resolver.lookups() == 5);
+  check("hosts file overrides the source", first(resolver.resolve("gateway.discord.gg").get()) == "192.0.2.7" && resolver.lookups() == 5);
+  check("hosts file skips what isn't an address", first(resolver.resolve("ignored").get()) == "10.0.0.1" && resolver.lookups() == 6);
+
+  // a slow name holds up neither another name nor a second ask for itself
+  auto slow = resolver.resolve("slow");
+  auto slower = resolver.resolve("slow");
+  auto fast = resolver.resolve("fast").get();
+
+  check("resolve around a slow lookup", first(fast) == "10.0.0.1" && slow.wait_for(0ms) == std::future_status::timeout);
+  check("resolve shares a lookup", first(slow.get()) == "10.0.0.1" && first(slower.get()) == "10.0.0.1" && resolver.lookups() == 8);
+}
+
+// happy eyeballs tries ::1 first, where nothing's listening, and has to
+// fall back to 127.0.0.1
+static void eyeballs() {
+  auto listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  auto addr = sockaddr_in();
+  auto size = socklen_t(sizeof(addr));
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  ::bind(listener, (sockaddr *) &addr, sizeof(addr));
+  ::listen(listener, 8);
+  ::getsockname(listener, (sockaddr *) &addr, &size);
+
+  auto port = ntohs(addr.sin_port);
+  auto found = ptyps::web::dns::answer{*ptyps::web::net::to_endpoint("127.0.0.1"), *ptyps::web::net::to_endpoint("::1")};
+
+  auto race = ptyps::web::net::Eyeballs(found, port);
+  auto id = race.run(std::chrono::seconds(2));
+
+  check("eyeballs falls back to ipv4", id && race.winner() && ptyps::web::net::get_addr(*race.winner()) == "127.0.0.1");
+
+  if (id)
+    ::close(*id);
+
+  ::close(listener);
+
+  auto none = ptyps::web::net::Eyeballs(found, port);
+  check("eyeballs gives up once everything's failed", !none.run(std::chrono::seconds(2)) && none.exhausted());
+}
+
+int main(int argc, char** argv) {
+  roundtrips();
+  bigs();
+  written();
+  rejects();
+  payloads();
+  inflates();
+  resolvers();
+  eyeballs();
+
+  printf("%d failed\r\n", failures);
+  return failures ? 1 : 0;
+}